@@ -6,6 +6,6 @@ then
 fi
 pushd build
 
-gcc ../code/main.cpp -DBUILD_X64 -DBUILD_POSIX
+gcc ../code/main.cpp -DBUILD_X64 -DBUILD_POSIX -lpthread
 
 popd
@@ -5,6 +5,7 @@
 #include <cstdint>
 #include <cstring>
 #include <cstdarg>
+#include <ctime>
 
 // NOTE(Alexander): rename static to better reflect its actual meaning
 #define internal static
@@ -555,7 +556,7 @@ for (auto it = map; it < map + map_count(map); it++)
 
 // NOTE(Alexander): string hash maps
 #define string_map(V) struct { cstring key; V value; }
-#define string_map_free(m) smfree(m)
+#define string_map_free(m) shfree(m)
 #define string_map_count(m) shlen(m)
 #define string_map_put(m, k, v) shput(m, k, v)
 #define string_map_get(m, k) shget(m, k)
@@ -633,6 +634,7 @@ struct Memory_Arena {
     umm curr_used;
     umm prev_used;
     umm min_block_size;
+    array(u8*)* blocks; // allocated by arena_grow, see arena_free_all
 };
 
 inline void
@@ -656,18 +658,27 @@ arena_initialize(Memory_Arena* arena, umm min_block_size) {
 
 inline void
 arena_grow(Memory_Arena* arena, umm block_size = 0) {
-    if (block_size == 0) {
-        if (arena->min_block_size == 0) {
-            arena->min_block_size = ARENA_DEFAULT_BLOCK_SIZE;
-        }
-        
-        block_size = arena->min_block_size;
+    if (arena->min_block_size == 0) {
+        arena->min_block_size = ARENA_DEFAULT_BLOCK_SIZE;
     }
+    block_size = max(block_size, arena->min_block_size);
     
-    arena->base = (u8*) calloc(1, arena->min_block_size);
+    arena->base = (u8*) calloc(1, block_size);
     arena->curr_used = 0;
     arena->prev_used = 0;
     arena->size = block_size;
+    array_push(arena->blocks, arena->base);
+}
+
+// NOTE(Alexander): frees every block the arena allocated, memory given to
+// arena_initialize is owned by the caller and isn't freed
+inline void
+arena_free_all(Memory_Arena* arena) {
+    for_array_v(arena->blocks, block, _) {
+        free(block);
+    }
+    array_free(arena->blocks);
+    *arena = {};
 }
 
 
@@ -677,7 +688,7 @@ arena_push_size(Memory_Arena* arena, umm size, umm align=DEFAULT_ALIGNMENT, umm
     umm offset = align_forward(current, align) - (umm) arena->base;
     
     if (offset + size > arena->size) {
-        arena_grow(arena);
+        arena_grow(arena, size + align);
         
         current = (umm) arena->base + arena->curr_used;
         offset = align_forward(current, align) - (umm) arena->base;
@@ -729,6 +740,14 @@ arena_clear(Memory_Arena* arena) {
     arena->prev_used = 0;
 }
 
+// NOTE(Alexander): wall clock time in seconds, used for simple benchmarking
+inline f64
+get_wall_clock_seconds() {
+    timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (f64) ts.tv_sec + (f64) ts.tv_nsec * 1e-9;
+}
+
 // NOTE(Alexander): forward declare
 struct Ast_Node;
 
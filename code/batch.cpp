@@ -0,0 +1,227 @@
+
+// Vector-at-a-time (columnar) execution of the bytecode.
+//
+// The same program is evaluated for many rows, where each row gives
+// different values to the variables. Instead of running the whole program
+// once per row, every instruction is executed for a block of rows at a time,
+// so each opcode becomes a tight loop over VM_BATCH_SIZE values that the
+// C compiler can auto-vectorize.
+//
+// Value registers and stack slots hold one column (VM_BATCH_SIZE values)
+// each, pointer registers hold a single slot index since push is the same
+// for every row.
+
+#define VM_BATCH_SIZE 1024
+
+struct Vm_Batch {
+    array(Bc_Instruction)* instructions;
+    u32 register_count;
+    u32 stack_count;
+    
+    s32* registers; // register_count*VM_BATCH_SIZE values
+    s32* pointers;  // register_count slot indices
+    s32* stack;     // stack_count*VM_BATCH_SIZE values
+    
+    map(u32, s32*)* inputs;  // push register -> input column
+    map(u32, s32*)* outputs; // push register -> output column (final value of the variable)
+    
+    // NOTE(Alexander): rows where a division trapped get 0 as their result, same as program_run
+    bool trapped[VM_BATCH_SIZE]; // rows of the current block
+    smm trapped_count;
+};
+
+void
+vm_batch_initialize(Vm_Batch* batch, array(Bc_Instruction)* instructions, u32 register_count) {
+    u32 stack_count = 0;
+    for_array(instructions, insn, _) {
+        assert(insn->opcode <= Bytecode_ret && "superinstructions are not supported in batch mode");
+        if (insn->opcode == Bytecode_push) {
+            stack_count += (u32) (insn->src0.Signed_Int / sizeof(s32));
+        }
+    }
+    
+    batch->instructions = instructions;
+    batch->register_count = register_count;
+    batch->stack_count = stack_count;
+    batch->registers = (s32*) calloc((umm) max(register_count, 1)*VM_BATCH_SIZE, sizeof(s32));
+    batch->pointers = (s32*) calloc(max(register_count, 1), sizeof(s32));
+    batch->stack = (s32*) calloc((umm) max(stack_count, 1)*VM_BATCH_SIZE, sizeof(s32));
+}
+
+void
+vm_batch_free(Vm_Batch* batch) {
+    free(batch->registers);
+    free(batch->pointers);
+    free(batch->stack);
+    map_free(batch->inputs);
+    map_free(batch->outputs);
+    *batch = {};
+}
+
+// NOTE(Alexander): slot is the s32* register of the variable, see Bc_Builder.locals
+void
+vm_batch_bind_input(Vm_Batch* batch, Bc_Operand slot, s32* column) {
+    assert(slot.kind == BcOperand_Register && slot.type == BcType_s32_ptr);
+    map_put(batch->inputs, slot.Register, column);
+}
+
+void
+vm_batch_bind_output(Vm_Batch* batch, Bc_Operand slot, s32* column) {
+    assert(slot.kind == BcOperand_Register && slot.type == BcType_s32_ptr);
+    map_put(batch->outputs, slot.Register, column);
+}
+
+void
+vm_batch_execute_block(Vm_Batch* batch, smm row_begin, s32 n, s32* result) {
+    s32* regs = batch->registers;
+    s32* ptrs = batch->pointers;
+    s32* stack = batch->stack;
+    s32 sp = 0;
+    memset(batch->trapped, 0, n*sizeof(bool));
+    
+#define BATCH_REG(op) (regs + (umm) (op).Register*VM_BATCH_SIZE)
+#define BATCH_SLOT(op) (stack + (umm) ptrs[(op).Register]*VM_BATCH_SIZE)
+    
+    for_array(batch->instructions, insn, _) {
+        switch (insn->opcode) {
+            case Bytecode_noop: break;
+            
+            case Bytecode_push: {
+                ptrs[insn->dest.Register] = sp;
+                s32* slot = stack + (umm) sp*VM_BATCH_SIZE;
+                s32* input = map_get(batch->inputs, insn->dest.Register);
+                if (input) {
+                    memcpy(slot, input + row_begin, n*sizeof(s32));
+                } else {
+                    memset(slot, 0, n*sizeof(s32));
+                }
+                sp += insn->src0.Signed_Int / (s32) sizeof(s32);
+            } break;
+            
+            case Bytecode_load: {
+                memcpy(BATCH_REG(insn->dest), BATCH_SLOT(insn->src0), n*sizeof(s32));
+            } break;
+            
+            case Bytecode_store: {
+                s32* dest = BATCH_SLOT(insn->src0);
+                if (insn->src1.kind == BcOperand_Int) {
+                    s32 value = insn->src1.Signed_Int;
+                    for (s32 i = 0; i < n; i++) dest[i] = value;
+                } else {
+                    memcpy(dest, BATCH_REG(insn->src1), n*sizeof(s32));
+                }
+            } break;
+            
+#define BATCH_BINARY_CASE(name, op_symbol) \
+case Bytecode_##name: { \
+s32* dest = BATCH_REG(insn->dest); \
+if (insn->src0.kind == BcOperand_Register && insn->src1.kind == BcOperand_Register) { \
+s32* a = BATCH_REG(insn->src0); \
+s32* b = BATCH_REG(insn->src1); \
+for (s32 i = 0; i < n; i++) dest[i] = a[i] op_symbol b[i]; \
+} else if (insn->src0.kind == BcOperand_Register) { \
+s32* a = BATCH_REG(insn->src0); \
+s32 b = insn->src1.Signed_Int; \
+for (s32 i = 0; i < n; i++) dest[i] = a[i] op_symbol b; \
+} else if (insn->src1.kind == BcOperand_Register) { \
+s32 a = insn->src0.Signed_Int; \
+s32* b = BATCH_REG(insn->src1); \
+for (s32 i = 0; i < n; i++) dest[i] = a op_symbol b[i]; \
+} else { \
+s32 value = insn->src0.Signed_Int op_symbol insn->src1.Signed_Int; \
+for (s32 i = 0; i < n; i++) dest[i] = value; \
+} \
+} break
+            
+            BATCH_BINARY_CASE(add, +);
+            BATCH_BINARY_CASE(sub, -);
+            BATCH_BINARY_CASE(mul, *);
+#undef BATCH_BINARY_CASE
+            
+            case Bytecode_div: {
+                s32* dest = BATCH_REG(insn->dest);
+                for (s32 i = 0; i < n; i++) {
+                    s32 a = insn->src0.kind == BcOperand_Int ? insn->src0.Signed_Int : BATCH_REG(insn->src0)[i];
+                    s32 b = insn->src1.kind == BcOperand_Int ? insn->src1.Signed_Int : BATCH_REG(insn->src1)[i];
+                    if (division_traps(a, b)) {
+                        batch->trapped[i] = true;
+                        dest[i] = 0;
+                    } else {
+                        dest[i] = a / b;
+                    }
+                }
+            } break;
+            
+            // NOTE(Alexander): strength reduction only emits these with a register src0 and an immediate src1
+#define BATCH_CALL_CASE(name) \
+case Bytecode_##name: { \
+s32* dest = BATCH_REG(insn->dest); \
+if (insn->src0.kind == BcOperand_Register && insn->src1.kind == BcOperand_Int) { \
+s32* a = BATCH_REG(insn->src0); \
+s32 b = insn->src1.Signed_Int; \
+for (s32 i = 0; i < n; i++) dest[i] = bc_##name(a[i], b); \
+} else { \
+for (s32 i = 0; i < n; i++) { \
+s32 a = insn->src0.kind == BcOperand_Int ? insn->src0.Signed_Int : BATCH_REG(insn->src0)[i]; \
+s32 b = insn->src1.kind == BcOperand_Int ? insn->src1.Signed_Int : BATCH_REG(insn->src1)[i]; \
+dest[i] = bc_##name(a, b); \
+} \
+} \
+} break
+            
+            BATCH_CALL_CASE(shl);
+            BATCH_CALL_CASE(shr);
+            BATCH_CALL_CASE(sar);
+            BATCH_CALL_CASE(mulhi);
+#undef BATCH_CALL_CASE
+            
+            case Bytecode_ret: {
+                s32* dest = result + row_begin;
+                if (insn->src0.kind == BcOperand_Int) {
+                    s32 value = insn->src0.Signed_Int;
+                    for (s32 i = 0; i < n; i++) dest[i] = value;
+                } else if (insn->src0.type == BcType_s32_ptr) {
+                    memcpy(dest, BATCH_SLOT(insn->src0), n*sizeof(s32));
+                } else {
+                    memcpy(dest, BATCH_REG(insn->src0), n*sizeof(s32));
+                }
+                goto block_done;
+            }
+            
+            default: {
+                assert(0 && "invalid bytecode opcode");
+            } break;
+        }
+    }
+    
+    // NOTE(Alexander): program didn't return anything
+    memset(result + row_begin, 0, n*sizeof(s32));
+    
+    block_done:
+    for (s32 i = 0; i < n; i++) {
+        if (batch->trapped[i]) {
+            result[row_begin + i] = 0;
+            batch->trapped_count++;
+        }
+    }
+    
+    for_map(batch->outputs, it) {
+        s32* slot = stack + (umm) ptrs[it->key]*VM_BATCH_SIZE;
+        memcpy(it->value + row_begin, slot, n*sizeof(s32));
+    }
+    
+#undef BATCH_REG
+#undef BATCH_SLOT
+}
+
+// NOTE(Alexander): result is the output column of the returned values,
+// it needs to hold row_count values same as every bound column.
+// Afterwards batch->trapped_count is the number of rows where a division trapped.
+void
+vm_batch_execute(Vm_Batch* batch, smm row_count, s32* result) {
+    batch->trapped_count = 0;
+    for (smm row_begin = 0; row_begin < row_count; row_begin += VM_BATCH_SIZE) {
+        s32 n = (s32) min(row_count - row_begin, VM_BATCH_SIZE);
+        vm_batch_execute_block(batch, row_begin, n, result);
+    }
+}
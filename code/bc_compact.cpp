@@ -0,0 +1,303 @@
+
+// Compact variable-length bytecode encoding.
+//
+// Every instruction starts with a 1-byte form that folds the opcode together
+// with the kind and type of each operand, e.g. `add_ri` is an add with a
+// register and an immediate source. The operands follow the form byte,
+// registers are unsigned LEB128 varints and integers are zigzag varints,
+// None operands take no space. So `s32 r4 = mul s32 r2, s32 r3` is 4 bytes
+// instead of sizeof(Bc_Instruction).
+//
+// Instructions that don't match any of the predefined forms are stored using
+// the generic form, which spells out the opcode and the operand forms.
+//
+// Source lines are kept out of the instruction stream, so the VM doesn't have
+// to skip them. They are stored in a separate line table with one entry per
+// line change: the number of instructions since the previous change (varint)
+// followed by the line delta (zigzag varint).
+
+enum Bc_Operand_Form {
+    BcForm_None,
+    BcForm_Reg,     // s32 register
+    BcForm_Reg_Ptr, // s32* register
+    BcForm_Int,     // s32 immediate
+    BcForm_Int_Ptr, // s32* immediate
+};
+
+// NOTE(Alexander): X-macro of the predefined forms (name, opcode, dest, src0, src1)
+#define DEF_COMPACT_FORMS \
+COMPACT(noop,     noop,  None,    None,    None) \
+COMPACT(push,     push,  Reg_Ptr, Int_Ptr, None) \
+COMPACT(load,     load,  Reg,     Reg_Ptr, None) \
+COMPACT(store_r,  store, None,    Reg_Ptr, Reg) \
+COMPACT(store_i,  store, None,    Reg_Ptr, Int) \
+COMPACT(add_rr,   add,   Reg,     Reg,     Reg) \
+COMPACT(add_ri,   add,   Reg,     Reg,     Int) \
+COMPACT(add_ir,   add,   Reg,     Int,     Reg) \
+COMPACT(add_ii,   add,   Reg,     Int,     Int) \
+COMPACT(sub_rr,   sub,   Reg,     Reg,     Reg) \
+COMPACT(sub_ri,   sub,   Reg,     Reg,     Int) \
+COMPACT(sub_ir,   sub,   Reg,     Int,     Reg) \
+COMPACT(sub_ii,   sub,   Reg,     Int,     Int) \
+COMPACT(mul_rr,   mul,   Reg,     Reg,     Reg) \
+COMPACT(mul_ri,   mul,   Reg,     Reg,     Int) \
+COMPACT(mul_ir,   mul,   Reg,     Int,     Reg) \
+COMPACT(mul_ii,   mul,   Reg,     Int,     Int) \
+COMPACT(div_rr,   div,   Reg,     Reg,     Reg) \
+COMPACT(div_ri,   div,   Reg,     Reg,     Int) \
+COMPACT(div_ir,   div,   Reg,     Int,     Reg) \
+COMPACT(div_ii,   div,   Reg,     Int,     Int) \
+COMPACT(shl_ri,   shl,   Reg,     Reg,     Int) \
+COMPACT(shr_ri,   shr,   Reg,     Reg,     Int) \
+COMPACT(sar_ri,   sar,   Reg,     Reg,     Int) \
+COMPACT(mulhi_ri, mulhi, Reg,     Reg,     Int) \
+COMPACT(ret_r,    ret,   Reg,     Reg,     None) \
+COMPACT(ret_p,    ret,   Reg,     Reg_Ptr, None) \
+COMPACT(ret_i,    ret,   Reg,     Int,     None)
+
+enum Bc_Compact_Opcode {
+#define COMPACT(name, ...) BcCompact_##name,
+    DEF_COMPACT_FORMS
+#undef COMPACT
+    BcCompact_generic, // followed by opcode, dest, src0 and src1 form bytes
+    BcCompact_Count,
+};
+
+struct Bc_Compact_Form {
+    Bc_Opcode opcode;
+    Bc_Operand_Form dest;
+    Bc_Operand_Form src0;
+    Bc_Operand_Form src1;
+};
+
+global const Bc_Compact_Form bc_compact_form_table[] = {
+#define COMPACT(name, opcode, dest, src0, src1) \
+{ Bytecode_##opcode, BcForm_##dest, BcForm_##src0, BcForm_##src1 },
+    DEF_COMPACT_FORMS
+#undef COMPACT
+};
+
+struct Bc_Compact_Program {
+    array(u8)* bytes;
+    array(u8)* lines; // line table
+    smm instruction_count;
+};
+
+inline void
+bc_write_varint(array(u8)** bytes, u32 value) {
+    while (value >= 0x80) {
+        array_push(*bytes, (u8) (value | 0x80));
+        value >>= 7;
+    }
+    array_push(*bytes, (u8) value);
+}
+
+inline u32
+bc_read_varint(u8** at) {
+    u8* curr = *at;
+    u32 result = *curr & 0x7F;
+    if (*curr++ & 0x80) {
+        u32 shift = 7;
+        do {
+            result |= (u32) (*curr & 0x7F) << shift;
+            shift += 7;
+        } while (*curr++ & 0x80);
+    }
+    *at = curr;
+    return result;
+}
+
+inline u32
+bc_zigzag_encode(s32 value) {
+    return ((u32) value << 1) ^ (u32) (value >> 31);
+}
+
+inline s32
+bc_zigzag_decode(u32 value) {
+    return (s32) (value >> 1) ^ -(s32) (value & 1);
+}
+
+Bc_Operand_Form
+bc_operand_form(Bc_Operand* operand) {
+    switch (operand->kind) {
+        case BcOperand_None: {
+            assert(operand->type == BcType_s32 && operand->Register == 0 &&
+                   "none operand cannot carry a value");
+            return BcForm_None;
+        }
+        
+        case BcOperand_Register: {
+            return operand->type == BcType_s32_ptr ? BcForm_Reg_Ptr : BcForm_Reg;
+        }
+        
+        case BcOperand_Int: {
+            return operand->type == BcType_s32_ptr ? BcForm_Int_Ptr : BcForm_Int;
+        }
+    }
+    
+    assert(0 && "invalid bytecode operand");
+    return BcForm_None;
+}
+
+void
+bc_compact_write_operand(array(u8)** bytes, Bc_Operand* operand) {
+    switch (operand->kind) {
+        case BcOperand_Register: bc_write_varint(bytes, operand->Register); break;
+        case BcOperand_Int: bc_write_varint(bytes, bc_zigzag_encode(operand->Signed_Int)); break;
+    }
+}
+
+Bc_Operand
+bc_compact_read_operand(u8** at, Bc_Operand_Form form) {
+    Bc_Operand result = {};
+    switch (form) {
+        case BcForm_Reg:
+        case BcForm_Reg_Ptr: {
+            result.kind = BcOperand_Register;
+            result.type = form == BcForm_Reg_Ptr ? BcType_s32_ptr : BcType_s32;
+            result.Register = bc_read_varint(at);
+        } break;
+        
+        case BcForm_Int:
+        case BcForm_Int_Ptr: {
+            result.kind = BcOperand_Int;
+            result.type = form == BcForm_Int_Ptr ? BcType_s32_ptr : BcType_s32;
+            result.Signed_Int = bc_zigzag_decode(bc_read_varint(at));
+        } break;
+    }
+    return result;
+}
+
+void
+bc_compact_encode_instruction(array(u8)** bytes, Bc_Instruction* insn) {
+    Bc_Operand_Form dest = bc_operand_form(&insn->dest);
+    Bc_Operand_Form src0 = bc_operand_form(&insn->src0);
+    Bc_Operand_Form src1 = bc_operand_form(&insn->src1);
+    
+    u8 compact_opcode = BcCompact_generic;
+    for (int form_index = 0; form_index < fixed_array_count(bc_compact_form_table); form_index++) {
+        const Bc_Compact_Form* form = &bc_compact_form_table[form_index];
+        if (form->opcode == insn->opcode && form->dest == dest &&
+            form->src0 == src0 && form->src1 == src1) {
+            compact_opcode = (u8) form_index;
+            break;
+        }
+    }
+    
+    array_push(*bytes, compact_opcode);
+    if (compact_opcode == BcCompact_generic) {
+        array_push(*bytes, (u8) insn->opcode);
+        array_push(*bytes, (u8) dest);
+        array_push(*bytes, (u8) src0);
+        array_push(*bytes, (u8) src1);
+    }
+    
+    bc_compact_write_operand(bytes, &insn->dest);
+    bc_compact_write_operand(bytes, &insn->src0);
+    bc_compact_write_operand(bytes, &insn->src1);
+}
+
+Bc_Instruction
+bc_compact_decode_instruction(u8** at) {
+    Bc_Compact_Form form;
+    u8 compact_opcode = *(*at)++;
+    if (compact_opcode == BcCompact_generic) {
+        form.opcode = (Bc_Opcode) *(*at)++;
+        form.dest = (Bc_Operand_Form) *(*at)++;
+        form.src0 = (Bc_Operand_Form) *(*at)++;
+        form.src1 = (Bc_Operand_Form) *(*at)++;
+    } else {
+        assert(compact_opcode < BcCompact_generic && "invalid compact opcode");
+        form = bc_compact_form_table[compact_opcode];
+    }
+    
+    Bc_Instruction result = {};
+    result.opcode = form.opcode;
+    result.dest = bc_compact_read_operand(at, form.dest);
+    result.src0 = bc_compact_read_operand(at, form.src0);
+    result.src1 = bc_compact_read_operand(at, form.src1);
+    return result;
+}
+
+Bc_Compact_Program
+bc_compact_encode(array(Bc_Instruction)* instructions) {
+    Bc_Compact_Program result = {};
+    u32 line = 0;
+    int line_index = 0;
+    for_array(instructions, insn, insn_index) {
+        bc_compact_encode_instruction(&result.bytes, insn);
+        if (insn->line != line) {
+            bc_write_varint(&result.lines, (u32) (insn_index - line_index));
+            bc_write_varint(&result.lines, bc_zigzag_encode((s32) (insn->line - line)));
+            line = insn->line;
+            line_index = insn_index;
+        }
+    }
+    result.instruction_count = array_count(instructions);
+    return result;
+}
+
+array(Bc_Instruction)*
+bc_compact_decode(Bc_Compact_Program* program) {
+    array(Bc_Instruction)* result = 0;
+    u8* at = program->bytes;
+    u8* end = program->bytes + array_count(program->bytes);
+    
+    u8* line_at = program->lines;
+    u8* line_end = program->lines + array_count(program->lines);
+    u32 line = 0;
+    smm next_line_index = line_at < line_end ? bc_read_varint(&line_at) : -1;
+    
+    for (smm insn_index = 0; at < end; insn_index++) {
+        Bc_Instruction insn = bc_compact_decode_instruction(&at);
+        if (insn_index == next_line_index) {
+            line += (u32) bc_zigzag_decode(bc_read_varint(&line_at));
+            next_line_index = line_at < line_end ? insn_index + bc_read_varint(&line_at) : -1;
+        }
+        insn.line = line;
+        array_push(result, insn);
+    }
+    return result;
+}
+
+void
+bc_compact_free(Bc_Compact_Program* program) {
+    array_free(program->bytes);
+    array_free(program->lines);
+    program->instruction_count = 0;
+}
+
+inline bool
+bc_operand_equals(Bc_Operand* a, Bc_Operand* b) {
+    return a->kind == b->kind && a->type == b->type && a->Register == b->Register;
+}
+
+inline bool
+bc_instruction_equals(Bc_Instruction* a, Bc_Instruction* b) {
+    return (a->opcode == b->opcode && a->line == b->line &&
+            bc_operand_equals(&a->dest, &b->dest) &&
+            bc_operand_equals(&a->src0, &b->src0) &&
+            bc_operand_equals(&a->src1, &b->src1));
+}
+
+// NOTE(Alexander): encodes, decodes and compares the result with the original program
+bool
+bc_compact_verify(array(Bc_Instruction)* instructions, Bc_Compact_Program* program) {
+    array(Bc_Instruction)* decoded = bc_compact_decode(program);
+    bool result = array_count(decoded) == array_count(instructions);
+    for (int i = 0; result && i < array_count(instructions); i++) {
+        result = bc_instruction_equals(&instructions[i], &decoded[i]);
+    }
+    array_free(decoded);
+    return result;
+}
+
+void
+bc_compact_print_stats(Bc_Compact_Program* program) {
+    umm size = array_count(program->bytes);
+    umm original_size = program->instruction_count*sizeof(Bc_Instruction);
+    f64 bytes_per_insn = program->instruction_count ? (f64) size / (f64) program->instruction_count : 0.0;
+    pln("Compact bytecode: % bytes for % instructions (% bytes/instruction, was % bytes), % bytes of lines",
+        f_umm(size), f_smm(program->instruction_count), f_float(bytes_per_insn), f_umm(original_size),
+        f_umm((umm) array_count(program->lines)));
+}
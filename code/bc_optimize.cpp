@@ -0,0 +1,739 @@
+
+// Optimization passes over the bytecode.
+//
+// Every pass takes the instructions produced by bc_build_expression (no
+// superinstructions) and returns a new optimized array, the input is left
+// untouched. Register numbers are kept, passes that need new registers (like
+// strength reduction) number them from register_count and increment it, so
+// Bc_Builder.next_free_register stays a valid register count.
+
+// NOTE(Alexander): maps a bytecode binary opcode to the AST operator the interpreter evaluates
+inline Binary_Op
+bc_binary_op(Bc_Opcode opcode) {
+    switch (opcode) {
+        case Bytecode_add: return Binop_Add;
+        case Bytecode_sub: return Binop_Sub;
+        case Bytecode_mul: return Binop_Mul;
+        case Bytecode_div: return Binop_Div;
+        
+        default: {
+            assert(0 && "not a binary opcode");
+        } break;
+    }
+    return Binop_Add;
+}
+
+inline Bc_Operand
+bc_int_operand(s32 value) {
+    Bc_Operand result = {};
+    result.kind = BcOperand_Int;
+    result.type = BcType_s32;
+    result.Signed_Int = value;
+    return result;
+}
+
+// NOTE(Alexander): returns false for divisions that trap, those are left for the runtime
+bool
+bc_evaluate_binary(Bc_Opcode opcode, s32 lhs, s32 rhs, s32* result) {
+    switch (opcode) {
+        case Bytecode_shl: *result = bc_shl(lhs, rhs); return true;
+        case Bytecode_shr: *result = bc_shr(lhs, rhs); return true;
+        case Bytecode_sar: *result = bc_sar(lhs, rhs); return true;
+        case Bytecode_mulhi: *result = bc_mulhi(lhs, rhs); return true;
+        
+        case Bytecode_add:
+        case Bytecode_sub:
+        case Bytecode_mul: break;
+        
+        case Bytecode_div: {
+            if (division_traps(lhs, rhs)) {
+                return false;
+            }
+        } break;
+        
+        default: {
+            assert(0 && "not a binary opcode");
+            return false;
+        } break;
+    }
+    
+    *result = interp_binary_integer(bc_binary_op(opcode), lhs, rhs);
+    return true;
+}
+
+// NOTE(Alexander): removes stores to slots that are never read and then the pushes
+// of slots that aren't used at all, free variables are always kept since they are read.
+array(Bc_Instruction)*
+bc_remove_dead_slots(array(Bc_Instruction)* instructions, u32 register_count) {
+    u32* read_counts = (u32*) calloc(max(register_count, 1), sizeof(u32));
+    u32* use_counts = (u32*) calloc(max(register_count, 1), sizeof(u32));
+    for_array(instructions, insn, _) {
+        bool is_store = insn->opcode == Bytecode_store;
+        if (insn->src0.kind == BcOperand_Register && insn->src0.type == BcType_s32_ptr && !is_store) {
+            read_counts[insn->src0.Register]++;
+        }
+        if (insn->src1.kind == BcOperand_Register && insn->src1.type == BcType_s32_ptr) {
+            read_counts[insn->src1.Register]++;
+        }
+    }
+    
+    array(Bc_Instruction)* stores_removed = 0;
+    for_array(instructions, insn, insn_index) {
+        if (insn->opcode == Bytecode_store && read_counts[insn->src0.Register] == 0) {
+            continue;
+        }
+        if (insn->src0.kind == BcOperand_Register) use_counts[insn->src0.Register]++;
+        if (insn->src1.kind == BcOperand_Register) use_counts[insn->src1.Register]++;
+        array_push(stores_removed, *insn);
+    }
+    
+    array(Bc_Instruction)* result = 0;
+    for_array(stores_removed, insn, push_index) {
+        if (insn->opcode == Bytecode_push && use_counts[insn->dest.Register] == 0) {
+            continue;
+        }
+        array_push(result, *insn);
+    }
+    
+    array_free(stores_removed);
+    free(read_counts);
+    free(use_counts);
+    return result;
+}
+
+// NOTE(Alexander): replaces the register sources of insn that a pass has given a new value,
+// registers without a value in register_values are kept.
+inline void
+bc_substitute_sources(Bc_Instruction* insn, Bc_Operand* register_values) {
+    assert(insn->opcode <= Bytecode_ret && "superinstructions can't be optimized");
+    
+    Bc_Operand* sources[] = { &insn->src0, &insn->src1 };
+    for (umm source_index = 0; source_index < fixed_array_count(sources); source_index++) {
+        Bc_Operand* source = sources[source_index];
+        if (source->kind == BcOperand_Register && source->type == BcType_s32 &&
+            register_values[source->Register].kind != BcOperand_None) {
+            *source = register_values[source->Register];
+        }
+    }
+}
+
+// NOTE(Alexander): constant folding and propagation through the straight-line bytecode.
+// Registers and variables with a known value are replaced by immediates, binary operations
+// on immediates are evaluated the same way as interp_expression does. Variables are
+// unknown until they are assigned, free variables are inputs to the program.
+array(Bc_Instruction)*
+bc_fold_constants(array(Bc_Instruction)* instructions, u32* register_count) {
+    u32 count = max(*register_count, 1);
+    Bc_Operand* register_values = (Bc_Operand*) calloc(count, sizeof(Bc_Operand));
+    Bc_Operand* slot_values = (Bc_Operand*) calloc(count, sizeof(Bc_Operand));
+    
+    array(Bc_Instruction)* folded = 0;
+    for_array(instructions, it, _) {
+        Bc_Instruction insn = *it;
+        
+        // NOTE(Alexander): replace registers and slots with their known values
+        bc_substitute_sources(&insn, register_values);
+        if (insn.opcode == Bytecode_ret && insn.src0.kind == BcOperand_Register &&
+            insn.src0.type == BcType_s32_ptr && slot_values[insn.src0.Register].kind == BcOperand_Int) {
+            insn.src0 = slot_values[insn.src0.Register];
+        }
+        
+        switch (insn.opcode) {
+            case Bytecode_noop: continue;
+            
+            case Bytecode_load: {
+                Bc_Operand value = slot_values[insn.src0.Register];
+                if (value.kind == BcOperand_Int) {
+                    register_values[insn.dest.Register] = value;
+                    continue;
+                }
+            } break;
+            
+            case Bytecode_store: {
+                slot_values[insn.src0.Register] = insn.src1.kind == BcOperand_Int ? insn.src1 : Bc_Operand{};
+            } break;
+            
+            case Bytecode_add:
+            case Bytecode_sub:
+            case Bytecode_mul:
+            case Bytecode_div:
+            case Bytecode_shl:
+            case Bytecode_shr:
+            case Bytecode_sar:
+            case Bytecode_mulhi: {
+                s32 value;
+                if (insn.src0.kind == BcOperand_Int && insn.src1.kind == BcOperand_Int &&
+                    bc_evaluate_binary(insn.opcode, insn.src0.Signed_Int, insn.src1.Signed_Int, &value)) {
+                    register_values[insn.dest.Register] = bc_int_operand(value);
+                    continue;
+                }
+            } break;
+            
+            case Bytecode_push:
+            case Bytecode_ret: break;
+            
+            default: {
+                assert(0 && "superinstructions can't be folded");
+            } break;
+        }
+        
+        array_push(folded, insn);
+    }
+    
+    array(Bc_Instruction)* result = bc_remove_dead_slots(folded, *register_count);
+    array_free(folded);
+    free(register_values);
+    free(slot_values);
+    return result;
+}
+
+// NOTE(Alexander): mem2reg, promotes the variable slots to registers. Since the bytecode is
+// straight-line every load simply becomes the value of the last store to the slot, so it's
+// already in SSA form without any phi nodes. Free variables keep their slot and a single load
+// of the input value, every other push, load and store is removed.
+array(Bc_Instruction)*
+bc_promote_slots(array(Bc_Instruction)* instructions, u32* register_count) {
+    u32 count = max(*register_count, 1);
+    Bc_Operand* slot_values = (Bc_Operand*) calloc(count, sizeof(Bc_Operand));
+    Bc_Operand* register_values = (Bc_Operand*) calloc(count, sizeof(Bc_Operand));
+    
+    array(Bc_Instruction)* promoted = 0;
+    for_array(instructions, it, _) {
+        Bc_Instruction insn = *it;
+        bc_substitute_sources(&insn, register_values);
+        
+        switch (insn.opcode) {
+            case Bytecode_load: {
+                Bc_Operand value = slot_values[insn.src0.Register];
+                if (value.kind != BcOperand_None) {
+                    register_values[insn.dest.Register] = value;
+                    continue;
+                }
+                
+                // NOTE(Alexander): first read of a free variable, the result is reused for the next loads
+                slot_values[insn.src0.Register] = insn.dest;
+            } break;
+            
+            case Bytecode_store: {
+                slot_values[insn.src0.Register] = insn.src1;
+                continue;
+            } break;
+            
+            case Bytecode_ret: {
+                if (insn.src0.kind == BcOperand_Register && insn.src0.type == BcType_s32_ptr &&
+                    slot_values[insn.src0.Register].kind != BcOperand_None) {
+                    insn.src0 = slot_values[insn.src0.Register];
+                }
+            } break;
+            
+            case Bytecode_noop:
+            case Bytecode_push:
+            case Bytecode_add:
+            case Bytecode_sub:
+            case Bytecode_mul:
+            case Bytecode_div:
+            case Bytecode_shl:
+            case Bytecode_shr:
+            case Bytecode_sar:
+            case Bytecode_mulhi: break;
+            
+            default: {
+                assert(0 && "superinstructions can't be promoted");
+            } break;
+        }
+        
+        array_push(promoted, insn);
+    }
+    
+    array(Bc_Instruction)* result = bc_remove_dead_slots(promoted, *register_count);
+    array_free(promoted);
+    free(slot_values);
+    free(register_values);
+    return result;
+}
+
+struct Bc_Value_Key {
+    Bc_Opcode opcode;
+    Bc_Operand src0;
+    Bc_Operand src1;
+};
+
+// NOTE(Alexander): registers go before immediates and lower registers first,
+// so `add r2, r1` and `add r1, r2` get the same key
+inline bool
+bc_operand_less(Bc_Operand a, Bc_Operand b) {
+    if (a.kind != b.kind) {
+        return a.kind == BcOperand_Register;
+    }
+    return a.kind == BcOperand_Register ? a.Register < b.Register : a.Signed_Int < b.Signed_Int;
+}
+
+// NOTE(Alexander): value numbering (CSE), an instruction that computes the same opcode and
+// operands as an earlier instruction is removed and its register is replaced by the earlier one.
+// Loads are numbered too until the slot is stored to again.
+array(Bc_Instruction)*
+bc_number_values(array(Bc_Instruction)* instructions, u32* register_count) {
+    Bc_Operand* register_values = (Bc_Operand*) calloc(max(*register_count, 1), sizeof(Bc_Operand));
+    map(Bc_Value_Key, Bc_Operand)* values = 0;
+    
+    array(Bc_Instruction)* result = 0;
+    for_array(instructions, it, _) {
+        Bc_Instruction insn = *it;
+        bc_substitute_sources(&insn, register_values);
+        
+        if (bc_is_commutative(insn.opcode) && bc_operand_less(insn.src1, insn.src0)) {
+            Bc_Operand tmp = insn.src0;
+            insn.src0 = insn.src1;
+            insn.src1 = tmp;
+        }
+        
+        if (insn.opcode == Bytecode_load || bc_is_arithmetic(insn.opcode)) {
+            // NOTE(Alexander): zeroed first, the key is hashed and compared as bytes
+            Bc_Value_Key key;
+            memset(&key, 0, sizeof(key));
+            key.opcode = insn.opcode;
+            key.src0 = insn.src0;
+            key.src1 = insn.src1;
+            
+            smm index = map_get_index(values, key);
+            if (index != -1) {
+                register_values[insn.dest.Register] = values[index].value;
+                continue;
+            }
+            map_put(values, key, insn.dest);
+            
+        } else if (insn.opcode == Bytecode_store) {
+            Bc_Value_Key key;
+            memset(&key, 0, sizeof(key));
+            key.opcode = Bytecode_load;
+            key.src0 = insn.src0;
+            map_remove(values, key);
+        }
+        
+        array_push(result, insn);
+    }
+    
+    map_free(values);
+    free(register_values);
+    return result;
+}
+
+inline Bc_Operand
+bc_new_register(u32* register_count) {
+    Bc_Operand result = {};
+    result.kind = BcOperand_Register;
+    result.type = BcType_s32;
+    result.Register = (*register_count)++;
+    return result;
+}
+
+inline void
+bc_emit(array(Bc_Instruction)** instructions, Bc_Opcode opcode,
+        Bc_Operand dest, Bc_Operand src0, Bc_Operand src1) {
+    Bc_Instruction insn = {};
+    insn.opcode = opcode;
+    insn.dest = dest;
+    insn.src0 = src0;
+    insn.src1 = src1;
+    array_push(*instructions, insn);
+}
+
+inline bool
+bc_is_power_of_two(u32 value) {
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+inline s32
+bc_log2(u32 value) {
+    s32 result = 0;
+    while (value >>= 1) result++;
+    return result;
+}
+
+struct Bc_Magic {
+    s32 multiplier;
+    s32 shift;
+};
+
+// NOTE(Alexander): magic number for signed division by d >= 2, from Granlund and Montgomery
+// "Division by Invariant Integers using Multiplication" (Hacker's Delight 10-1). For n >= 0
+// n / d = (mulhi(n, multiplier) + (multiplier < 0 ? n : 0)) >> shift, negative n adds one.
+Bc_Magic
+bc_signed_magic(s32 d) {
+    assert(d >= 2 && "magic numbers are only computed for positive divisors");
+    const u32 two31 = 0x80000000u;
+    u32 ad = (u32) d;
+    u32 anc = two31 - 1 - two31 % ad; // largest n that is one less than a multiple of d
+    s32 p = 31;
+    u32 q1 = two31 / anc;
+    u32 r1 = two31 - q1*anc;
+    u32 q2 = two31 / ad;
+    u32 r2 = two31 - q2*ad;
+    u32 delta = 0;
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    
+    Bc_Magic result;
+    result.multiplier = (s32) (q2 + 1);
+    result.shift = p - 32;
+    return result;
+}
+
+// NOTE(Alexander): dest = n * c with at most a shift and an add or sub, returns false when
+// imul is cheaper. Shifts wrap the same way as the multiply so the result is exact for every n.
+bool
+bc_reduce_multiply(array(Bc_Instruction)** result, u32* register_count,
+                   Bc_Operand dest, Bc_Operand n, s32 c) {
+    u32 value = (u32) c;
+    if (bc_is_power_of_two(value)) {
+        // n * 2^k -> n << k, this includes S32_MIN
+        bc_emit(result, Bytecode_shl, dest, n, bc_int_operand(bc_log2(value)));
+        
+    } else if (c > 0 && bc_is_power_of_two(value - 1)) {
+        // n * (2^k + 1) -> (n << k) + n
+        Bc_Operand shifted = bc_new_register(register_count);
+        bc_emit(result, Bytecode_shl, shifted, n, bc_int_operand(bc_log2(value - 1)));
+        bc_emit(result, Bytecode_add, dest, shifted, n);
+        
+    } else if (c > 0 && bc_is_power_of_two(value + 1)) {
+        // n * (2^k - 1) -> (n << k) - n
+        Bc_Operand shifted = bc_new_register(register_count);
+        bc_emit(result, Bytecode_shl, shifted, n, bc_int_operand(bc_log2(value + 1)));
+        bc_emit(result, Bytecode_sub, dest, shifted, n);
+        
+    } else if (c < 0 && bc_is_power_of_two(0u - value)) {
+        // n * -2^k -> 0 - (n << k)
+        Bc_Operand shifted = n;
+        s32 shift = bc_log2(0u - value);
+        if (shift > 0) {
+            shifted = bc_new_register(register_count);
+            bc_emit(result, Bytecode_shl, shifted, n, bc_int_operand(shift));
+        }
+        bc_emit(result, Bytecode_sub, dest, bc_int_operand(0), shifted);
+        
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// NOTE(Alexander): dest = n / d rounded toward zero like idiv, returns false for the divisors
+// that are left to the division: 0 and -1 can trap and S32_MIN has no positive counterpart.
+bool
+bc_reduce_divide(array(Bc_Instruction)** result, u32* register_count,
+                 Bc_Operand dest, Bc_Operand n, s32 d) {
+    if (d == 0 || d == -1 || d == S32_MIN) {
+        return false;
+    }
+    
+    // NOTE(Alexander): n / -d is -(n / d) when rounding toward zero
+    u32 ad = d < 0 ? (u32) -d : (u32) d;
+    Bc_Operand quotient = d < 0 ? bc_new_register(register_count) : dest;
+    
+    if (bc_is_power_of_two(ad)) {
+        // (n + (negative n ? 2^k - 1 : 0)) >> k, the bias makes the shift round toward zero
+        s32 shift = bc_log2(ad);
+        Bc_Operand sign = n;
+        if (shift > 1) {
+            sign = bc_new_register(register_count);
+            bc_emit(result, Bytecode_sar, sign, n, bc_int_operand(31));
+        }
+        Bc_Operand bias = bc_new_register(register_count);
+        bc_emit(result, Bytecode_shr, bias, sign, bc_int_operand(32 - shift));
+        Bc_Operand biased = bc_new_register(register_count);
+        bc_emit(result, Bytecode_add, biased, n, bias);
+        bc_emit(result, Bytecode_sar, quotient, biased, bc_int_operand(shift));
+        
+    } else {
+        Bc_Magic magic = bc_signed_magic((s32) ad);
+        Bc_Operand estimate = bc_new_register(register_count);
+        bc_emit(result, Bytecode_mulhi, estimate, n, bc_int_operand(magic.multiplier));
+        if (magic.multiplier < 0) {
+            Bc_Operand sum = bc_new_register(register_count);
+            bc_emit(result, Bytecode_add, sum, estimate, n);
+            estimate = sum;
+        }
+        if (magic.shift > 0) {
+            Bc_Operand shifted = bc_new_register(register_count);
+            bc_emit(result, Bytecode_sar, shifted, estimate, bc_int_operand(magic.shift));
+            estimate = shifted;
+        }
+        
+        // NOTE(Alexander): the estimate is rounded down, negative n adds one to round toward zero
+        Bc_Operand sign = bc_new_register(register_count);
+        bc_emit(result, Bytecode_shr, sign, n, bc_int_operand(31));
+        bc_emit(result, Bytecode_add, quotient, estimate, sign);
+    }
+    
+    if (d < 0) {
+        bc_emit(result, Bytecode_sub, dest, bc_int_operand(0), quotient);
+    }
+    return true;
+}
+
+// NOTE(Alexander): strength reduction, multiplies and divides by a constant become shifts,
+// adds and mulhi. Multiplying by 1 or 0 and dividing by 1 only forward the value. Constants
+// are expected as immediates so this runs after constant folding, the new temporaries are
+// numbered after the existing registers.
+array(Bc_Instruction)*
+bc_reduce_strength(array(Bc_Instruction)* instructions, u32* register_count) {
+    u32 count = max(*register_count, 1);
+    Bc_Operand* register_values = (Bc_Operand*) calloc(count, sizeof(Bc_Operand));
+    
+    array(Bc_Instruction)* result = 0;
+    for_array(instructions, it, _) {
+        Bc_Instruction insn = *it;
+        bc_substitute_sources(&insn, register_values);
+        
+        if (insn.opcode == Bytecode_mul && insn.src0.kind == BcOperand_Int) {
+            Bc_Operand tmp = insn.src0;
+            insn.src0 = insn.src1;
+            insn.src1 = tmp;
+        }
+        
+        if ((insn.opcode == Bytecode_mul || insn.opcode == Bytecode_div) &&
+            insn.src0.kind == BcOperand_Register && insn.src1.kind == BcOperand_Int) {
+            s32 constant = insn.src1.Signed_Int;
+            if (constant == 1) {
+                register_values[insn.dest.Register] = insn.src0;
+                continue;
+            }
+            if (insn.opcode == Bytecode_mul && constant == 0) {
+                register_values[insn.dest.Register] = bc_int_operand(0);
+                continue;
+            }
+            
+            smm first = array_count(result);
+            bool is_reduced = insn.opcode == Bytecode_mul ?
+                bc_reduce_multiply(&result, register_count, insn.dest, insn.src0, constant) :
+                bc_reduce_divide(&result, register_count, insn.dest, insn.src0, constant);
+            if (is_reduced) {
+                for (smm reduced_index = first; reduced_index < array_count(result); reduced_index++) {
+                    result[reduced_index].line = insn.line;
+                }
+                continue;
+            }
+        }
+        
+        array_push(result, insn);
+    }
+    
+    free(register_values);
+    return result;
+}
+
+// NOTE(Alexander): checks that the bytecode is well formed, every register is defined once
+// before it's used and slots are only created by push. Prints the first problem it finds.
+bool
+bc_verify(array(Bc_Instruction)* instructions, u32 register_count) {
+    enum { Register_Undefined, Register_Value, Register_Slot };
+    u8* definitions = (u8*) calloc(max(register_count, 1), sizeof(u8));
+    
+    cstring error = 0;
+    smm error_index = 0;
+    for_array(instructions, insn, insn_index) {
+        error_index = insn_index;
+        if (insn->opcode >= Bytecode_Count) {
+            error = "invalid opcode";
+            break;
+        }
+        
+        Bc_Operand* sources[] = { &insn->src0, &insn->src1 };
+        for (umm source_index = 0; source_index < fixed_array_count(sources); source_index++) {
+            Bc_Operand* source = sources[source_index];
+            if (source->kind != BcOperand_Register) continue;
+            
+            if (source->Register >= register_count) {
+                error = "register out of range";
+            } else if (definitions[source->Register] == Register_Undefined) {
+                error = "register is used before it's defined";
+            } else if ((definitions[source->Register] == Register_Slot) != (source->type == BcType_s32_ptr)) {
+                error = "register is used with the wrong type";
+            }
+        }
+        if (error) break;
+        
+        if (insn->dest.kind == BcOperand_Register) {
+            if (insn->dest.Register >= register_count) {
+                error = "register out of range";
+            } else if (definitions[insn->dest.Register] != Register_Undefined) {
+                error = "register is defined more than once";
+            } else if ((insn->opcode == Bytecode_push) != (insn->dest.type == BcType_s32_ptr)) {
+                error = "only push can define a slot";
+            } else {
+                definitions[insn->dest.Register] = insn->opcode == Bytecode_push ? Register_Slot : Register_Value;
+            }
+        }
+        if (error) break;
+    }
+    
+    if (error) {
+        String_Builder sb = {};
+        string_builder_push(&sb, &instructions[error_index]);
+        pln("error: invalid bytecode at instruction %: %\n    %", f_smm(error_index), f_cstring(error),
+            f_string(string_builder_to_string_nocopy(&sb)));
+        string_builder_free(&sb);
+    }
+    
+    free(definitions);
+    return error == 0;
+}
+
+// Pass manager
+
+typedef array(Bc_Instruction)* Bc_Pass_Proc(array(Bc_Instruction)* instructions, u32* register_count);
+
+// NOTE(Alexander): X-macro of the registered passes (name, proc)
+#define DEF_BC_PASSES \
+BC_PASS(mem2reg,  bc_promote_slots) \
+BC_PASS(fold,     bc_fold_constants) \
+BC_PASS(strength, bc_reduce_strength) \
+BC_PASS(gvn,      bc_number_values)
+
+enum Bc_Pass_Kind {
+#define BC_PASS(name, ...) BcPass_##name,
+    DEF_BC_PASSES
+#undef BC_PASS
+    BcPass_Count,
+};
+
+global const cstring bc_pass_names[] = {
+#define BC_PASS(name, ...) #name,
+    DEF_BC_PASSES
+#undef BC_PASS
+};
+
+global Bc_Pass_Proc* const bc_pass_procs[] = {
+#define BC_PASS(name, proc) proc,
+    DEF_BC_PASSES
+#undef BC_PASS
+};
+
+struct Bc_Pass_Stats {
+    Bc_Pass_Kind kind;
+    f64 seconds;
+    smm instructions_before;
+    smm instructions_after;
+};
+
+struct Bc_Pass_Manager {
+    array(Bc_Pass_Kind)* passes;
+    array(Bc_Pass_Stats)* stats; // one entry per pass of the last run
+};
+
+void
+bc_pass_manager_add(Bc_Pass_Manager* pm, Bc_Pass_Kind kind) {
+    array_push(pm->passes, kind);
+}
+
+// NOTE(Alexander): -O0 runs nothing, -O1 removes the memory traffic, -O2 also folds
+// constants, reduces strength and removes common subexpressions
+void
+bc_pass_manager_add_pipeline(Bc_Pass_Manager* pm, int level) {
+    if (level >= 1) {
+        bc_pass_manager_add(pm, BcPass_mem2reg);
+    }
+    if (level >= 2) {
+        bc_pass_manager_add(pm, BcPass_fold);
+        bc_pass_manager_add(pm, BcPass_strength);
+        bc_pass_manager_add(pm, BcPass_gvn);
+    }
+}
+
+// NOTE(Alexander): parses a comma separated list of pass names, e.g. "mem2reg,fold"
+bool
+bc_pass_manager_add_list(Bc_Pass_Manager* pm, cstring list) {
+    cstring at = list;
+    while (*at) {
+        cstring end = at;
+        while (*end && *end != ',') end++;
+        
+        string name = create_string((smm) (end - at), (u8*) at);
+        int kind = 0;
+        for (; kind < BcPass_Count; kind++) {
+            if (string_equals(name, string_lit(bc_pass_names[kind]))) {
+                break;
+            }
+        }
+        if (kind == BcPass_Count) {
+            pln("error: unknown bytecode pass `%`", f_string(name));
+            return false;
+        }
+        bc_pass_manager_add(pm, (Bc_Pass_Kind) kind);
+        
+        at = *end ? end + 1 : end;
+    }
+    return true;
+}
+
+// NOTE(Alexander): returns the optimized program, the input instructions are left untouched.
+// register_count is increased by passes that add registers. In debug builds the bytecode is
+// verified before the first and after every pass.
+array(Bc_Instruction)*
+bc_pass_manager_run(Bc_Pass_Manager* pm, array(Bc_Instruction)* instructions, u32* register_count) {
+    array_set_count(pm->stats, 0);
+    
+#if BUILD_DEBUG
+    bool is_valid = bc_verify(instructions, *register_count);
+    assert(is_valid && "invalid bytecode before the first pass");
+#endif
+    
+    array(Bc_Instruction)* result = 0;
+    for_array(instructions, insn, insn_index) {
+        array_push(result, *insn);
+    }
+    for_array_v(pm->passes, kind, _) {
+        Bc_Pass_Stats stats = {};
+        stats.kind = kind;
+        stats.instructions_before = array_count(result);
+        
+        f64 begin = get_wall_clock_seconds();
+        array(Bc_Instruction)* next = bc_pass_procs[kind](result, register_count);
+        stats.seconds = get_wall_clock_seconds() - begin;
+        array_free(result);
+        result = next;
+        
+        stats.instructions_after = array_count(result);
+        array_push(pm->stats, stats);
+        
+#if BUILD_DEBUG
+        is_valid = bc_verify(result, *register_count);
+        assert(is_valid && "invalid bytecode after pass");
+#endif
+    }
+    
+    return result;
+}
+
+void
+bc_pass_manager_print_stats(Bc_Pass_Manager* pm) {
+    pln("Bytecode passes:");
+    f64 total_seconds = 0.0;
+    for_array(pm->stats, stats, _) {
+        pln("  %: % ms, % -> % instructions", f_cstring(bc_pass_names[stats->kind]),
+            f_float(stats->seconds*1e3), f_smm(stats->instructions_before), f_smm(stats->instructions_after));
+        total_seconds += stats->seconds;
+    }
+    pln("  total: % ms\n", f_float(total_seconds*1e3));
+}
+
+void
+bc_pass_manager_free(Bc_Pass_Manager* pm) {
+    array_free(pm->passes);
+    array_free(pm->stats);
+    *pm = {};
+}
@@ -8,12 +8,37 @@ enum Bc_Opcode {
     Bytecode_sub,   // dest = src0 - src1
     Bytecode_mul,   // dest = src0 * src1
     Bytecode_div,   // dest = src0 / src1
+    Bytecode_shl,   // dest = src0 << src1
+    Bytecode_shr,   // dest = src0 >> src1 (logical)
+    Bytecode_sar,   // dest = src0 >> src1 (arithmetic)
+    Bytecode_mulhi, // dest = high 32 bits of src0 * src1
     Bytecode_ret,   // returns src0
+    
+    // Superinstructions, see bc_fuse_superinstructions
+    Bytecode_add_imm,   // dest = src0 + imm src1
+    Bytecode_sub_imm,   // dest = src0 - imm src1
+    Bytecode_mul_imm,   // dest = src0 * imm src1
+    Bytecode_div_imm,   // dest = src0 / imm src1
+    Bytecode_add_load,  // dest = src0 + *src1
+    Bytecode_sub_load,  // dest = src0 - *src1
+    Bytecode_mul_load,  // dest = src0 * *src1
+    Bytecode_div_load,  // dest = src0 / *src1
+    Bytecode_store_imm, // *src0 = imm src1
+    Bytecode_ret_add,   // returns src0 + src1
+    Bytecode_ret_sub,   // returns src0 - src1
+    Bytecode_ret_mul,   // returns src0 * src1
+    Bytecode_ret_div,   // returns src0 / src1
     // ... 
+    
+    Bytecode_Count,
 };
 
 const cstring opcode_names[] = {
-    "noop", "push", "load", "store", "add", "sub", "mul", "div", "ret"
+    "noop", "push", "load", "store", "add", "sub", "mul", "div",
+    "shl", "shr", "sar", "mulhi", "ret",
+    "add_imm", "sub_imm", "mul_imm", "div_imm",
+    "add_load", "sub_load", "mul_load", "div_load",
+    "store_imm", "ret_add", "ret_sub", "ret_mul", "ret_div"
 };
 
 enum Bc_Type {
@@ -41,6 +66,7 @@ struct Bc_Instruction {
     Bc_Operand dest;
     Bc_Operand src0;
     Bc_Operand src1;
+    u32 line; // source line of the statement it was built from, 0 if unknown
 };
 
 Bc_Instruction
@@ -180,13 +206,24 @@ result = bc_binary(bc, Bytecode_##opcode, lhs, rhs); \
             }
         } break;
         
+        // NOTE(Alexander): the instructions of each statement get its line, nested blocks
+        // have already set theirs and the ret belongs to the last statement
         case Ast_Block: {
             Bc_Operand result = {};
-            for_array_v(node->Block.exprs, expr, _) {
-                result= bc_build_expression(bc, expr);
+            u32 line = 0;
+            for_array_v(node->Block.exprs, expr, expr_index) {
+                smm first = array_count(bc->instructions);
+                result = bc_build_expression(bc, expr);
+                line = expr_index < array_count(node->Block.lines) ? node->Block.lines[expr_index] : 0;
+                for (smm insn_index = first; insn_index < array_count(bc->instructions); insn_index++) {
+                    if (!bc->instructions[insn_index].line) {
+                        bc->instructions[insn_index].line = line;
+                    }
+                }
             }
             if (result.kind != BcOperand_None) {
                 bc_ret(bc, result);
+                array_last(bc->instructions).line = line;
             }
             
         } break;
@@ -195,6 +232,170 @@ result = bc_binary(bc, Bytecode_##opcode, lhs, rhs); \
     return result;
 }
 
+inline bool
+bc_is_binary(Bc_Opcode opcode) {
+    return opcode >= Bytecode_add && opcode <= Bytecode_div;
+}
+
+inline bool
+bc_is_commutative(Bc_Opcode opcode) {
+    return opcode == Bytecode_add || opcode == Bytecode_mul || opcode == Bytecode_mulhi;
+}
+
+// NOTE(Alexander): the binary opcodes plus the ones introduced by strength reduction,
+// these don't have an AST operator or superinstructions.
+inline bool
+bc_is_arithmetic(Bc_Opcode opcode) {
+    return opcode >= Bytecode_add && opcode <= Bytecode_mulhi;
+}
+
+// NOTE(Alexander): these wrap the same way as the x64 instructions, shift counts are masked to 0-31
+inline s32
+bc_shl(s32 value, s32 count) {
+    return (s32) ((u32) value << (count & 31));
+}
+
+inline s32
+bc_shr(s32 value, s32 count) {
+    return (s32) ((u32) value >> (count & 31));
+}
+
+inline s32
+bc_sar(s32 value, s32 count) {
+    return value >> (count & 31);
+}
+
+inline s32
+bc_mulhi(s32 lhs, s32 rhs) {
+    return (s32) (((s64) lhs * (s64) rhs) >> 32);
+}
+
+inline bool
+bc_is_register(Bc_Operand operand, u32 reg) {
+    return operand.kind == BcOperand_Register && operand.Register == reg;
+}
+
+// NOTE(Alexander): free variables are read before they are assigned, e.g. x in `y = x * 2; y;`.
+// Returns the push registers of the free variables in the order they are pushed.
+array(u32)*
+bc_find_free_variables(array(Bc_Instruction)* instructions, u32 register_count) {
+    enum { Slot_Unused, Slot_Assigned, Slot_Free };
+    u8* slot_states = (u8*) calloc(max(register_count, 1), sizeof(u8));
+    
+    for_array(instructions, insn, _) {
+        if (insn->opcode == Bytecode_push) {
+            continue;
+        }
+        
+        if (insn->opcode == Bytecode_store || insn->opcode == Bytecode_store_imm) {
+            if (slot_states[insn->src0.Register] == Slot_Unused) {
+                slot_states[insn->src0.Register] = Slot_Assigned;
+            }
+            continue;
+        }
+        
+        Bc_Operand* sources[] = { &insn->src0, &insn->src1 };
+        for (int source_index = 0; source_index < fixed_array_count(sources); source_index++) {
+            Bc_Operand* source = sources[source_index];
+            if (source->kind == BcOperand_Register && source->type == BcType_s32_ptr &&
+                slot_states[source->Register] == Slot_Unused) {
+                slot_states[source->Register] = Slot_Free;
+            }
+        }
+    }
+    
+    array(u32)* result = 0;
+    for_array(instructions, insn, insn_index) {
+        if (insn->opcode == Bytecode_push && slot_states[insn->dest.Register] == Slot_Free) {
+            array_push(result, insn->dest.Register);
+        }
+    }
+    
+    free(slot_states);
+    return result;
+}
+
+// NOTE(Alexander): rewrites common instruction pairs into superinstructions,
+// these are only understood by the VM. Fusing two instructions is only done
+// when the temporary register between them isn't used anywhere else.
+array(Bc_Instruction)*
+bc_fuse_superinstructions(array(Bc_Instruction)* instructions, u32 register_count) {
+    array(Bc_Instruction)* result = 0;
+    
+    u32* use_counts = (u32*) calloc(max(register_count, 1), sizeof(u32));
+    for_array(instructions, it, _) {
+        if (it->src0.kind == BcOperand_Register) use_counts[it->src0.Register]++;
+        if (it->src1.kind == BcOperand_Register) use_counts[it->src1.Register]++;
+    }
+    
+    smm count = array_count(instructions);
+    for (smm i = 0; i < count; i++) {
+        Bc_Instruction insn = instructions[i];
+        Bc_Instruction* next = i + 1 < count ? &instructions[i + 1] : 0;
+        
+        // load t, p; op d, a, t -> op_load d, a, p
+        if (insn.opcode == Bytecode_load && next && bc_is_binary(next->opcode) &&
+            use_counts[insn.dest.Register] == 1) {
+            u32 temp = insn.dest.Register;
+            Bc_Operand other = {};
+            if (bc_is_register(next->src1, temp)) {
+                other = next->src0;
+            } else if (bc_is_register(next->src0, temp) && bc_is_commutative(next->opcode)) {
+                other = next->src1;
+            }
+            
+            if (other.kind == BcOperand_Register && other.Register != temp) {
+                Bc_Instruction fused = {};
+                fused.opcode = (Bc_Opcode) (Bytecode_add_load + (next->opcode - Bytecode_add));
+                fused.dest = next->dest;
+                fused.src0 = other;
+                fused.src1 = insn.src0;
+                fused.line = next->line;
+                array_push(result, fused);
+                i++;
+                continue;
+            }
+        }
+        
+        // op t, a, b; ret t -> ret_op a, b
+        if (bc_is_binary(insn.opcode) && next && next->opcode == Bytecode_ret &&
+            bc_is_register(next->src0, insn.dest.Register) &&
+            next->src0.type == BcType_s32 &&
+            use_counts[insn.dest.Register] == 1) {
+            Bc_Instruction fused = insn;
+            fused.opcode = (Bc_Opcode) (Bytecode_ret_add + (insn.opcode - Bytecode_add));
+            fused.dest = next->dest;
+            array_push(result, fused);
+            i++;
+            continue;
+        }
+        
+        // op d, r, imm -> op_imm d, r, imm
+        if (bc_is_binary(insn.opcode)) {
+            if (insn.src0.kind == BcOperand_Int && insn.src1.kind == BcOperand_Register &&
+                bc_is_commutative(insn.opcode)) {
+                Bc_Operand tmp = insn.src0;
+                insn.src0 = insn.src1;
+                insn.src1 = tmp;
+            }
+            
+            if (insn.src0.kind == BcOperand_Register && insn.src1.kind == BcOperand_Int) {
+                insn.opcode = (Bc_Opcode) (Bytecode_add_imm + (insn.opcode - Bytecode_add));
+            }
+        }
+        
+        // store p, imm -> store_imm p, imm
+        if (insn.opcode == Bytecode_store && insn.src1.kind == BcOperand_Int) {
+            insn.opcode = Bytecode_store_imm;
+        }
+        
+        array_push(result, insn);
+    }
+    
+    free(use_counts);
+    return result;
+}
+
 bool
 string_builder_push(String_Builder* sb, Bc_Operand* operand) {
     if (operand->kind == BcOperand_None) {
@@ -0,0 +1,277 @@
+
+// Closure compiler, an alternative to interp_expression that compiles the AST
+// once into a tree of specialized closures. Each closure is a function pointer
+// with its constants and variable slots baked in, e.g. `x * 2` becomes a single
+// mul_slot_const closure, so evaluating it is just a chain of indirect calls
+// without any switching on ast->kind or Binary.op.
+//
+// Variables are resolved to slot indices at compile time, the caller provides
+// the slots array (slot_count values) when evaluating the program.
+//
+// A division that traps gives 0 and sets program->runtime_error, the result
+// of the run is 0 then, same as the interpreter.
+
+struct Closure;
+typedef s32 Closure_Proc(Closure* closure, s32* slots);
+
+struct Closure {
+    Closure_Proc* proc;
+    Closure* lhs;
+    Closure* rhs;
+    s32 lhs_value; // constant or slot index of the lhs, depending on proc
+    s32 rhs_value; // constant or slot index of the rhs, depending on proc
+    Closure* next; // next expression in the enclosing block
+};
+
+struct Closure_Program {
+    Memory_Arena arena;
+    map(string_id, s32)* slot_indices;
+    s32 slot_count;
+    Closure* root;
+    cstring runtime_error; // set by closure_execute when a division trapped, 0 otherwise
+};
+
+// NOTE(Alexander): closures don't point back to their program, so the division
+// reports a trap here and closure_execute moves it to the program
+global thread_local cstring closure_runtime_error;
+
+internal s32
+closure_const(Closure* c, s32* slots) {
+    return c->lhs_value;
+}
+
+internal s32
+closure_slot(Closure* c, s32* slots) {
+    return slots[c->lhs_value];
+}
+
+// NOTE(Alexander): the expressions of a block is a linked list starting at lhs
+internal s32
+closure_block(Closure* c, s32* slots) {
+    s32 result = 0;
+    for (Closure* expr = c->lhs; expr; expr = expr->next) {
+        result = expr->proc(expr, slots);
+    }
+    return result;
+}
+
+// NOTE(Alexander): assignments evaluate to void, which reads as 0 same as in the interpreter
+internal s32
+closure_assign_slot_node(Closure* c, s32* slots) {
+    slots[c->lhs_value] = c->rhs->proc(c->rhs, slots);
+    return 0;
+}
+
+internal s32
+closure_assign_slot_const(Closure* c, s32* slots) {
+    slots[c->lhs_value] = c->rhs_value;
+    return 0;
+}
+
+internal s32
+closure_assign_slot_slot(Closure* c, s32* slots) {
+    slots[c->lhs_value] = slots[c->rhs_value];
+    return 0;
+}
+
+internal s32
+closure_assign_none(Closure* c, s32* slots) {
+    c->rhs->proc(c->rhs, slots);
+    return 0;
+}
+
+#define CLOSURE_BINARY_OPERATION(name, op_symbol) \
+inline s32 closure_##name(s32 lhs, s32 rhs) { return lhs op_symbol rhs; }
+
+CLOSURE_BINARY_OPERATION(add, +)
+CLOSURE_BINARY_OPERATION(sub, -)
+CLOSURE_BINARY_OPERATION(mul, *)
+#undef CLOSURE_BINARY_OPERATION
+
+inline s32
+closure_div(s32 lhs, s32 rhs) {
+    if (division_traps(lhs, rhs)) {
+        closure_runtime_error = RUNTIME_ERROR_DIVISION;
+        return 0;
+    }
+    return lhs / rhs;
+}
+
+// NOTE(Alexander): operands shapes of binary closures, n = node, s = slot, c = constant.
+// The lhs is always evaluated before the rhs same as in the interpreter.
+#define CLOSURE_BINARY_PROCS(name) \
+internal s32 closure_##name##_nn(Closure* c, s32* slots) { \
+s32 lhs = c->lhs->proc(c->lhs, slots); \
+s32 rhs = c->rhs->proc(c->rhs, slots); \
+return closure_##name(lhs, rhs); \
+} \
+internal s32 closure_##name##_nc(Closure* c, s32* slots) { \
+return closure_##name(c->lhs->proc(c->lhs, slots), c->rhs_value); \
+} \
+internal s32 closure_##name##_ss(Closure* c, s32* slots) { \
+return closure_##name(slots[c->lhs_value], slots[c->rhs_value]); \
+} \
+internal s32 closure_##name##_sc(Closure* c, s32* slots) { \
+return closure_##name(slots[c->lhs_value], c->rhs_value); \
+} \
+internal s32 closure_##name##_cs(Closure* c, s32* slots) { \
+return closure_##name(c->lhs_value, slots[c->rhs_value]); \
+}
+
+CLOSURE_BINARY_PROCS(add)
+CLOSURE_BINARY_PROCS(sub)
+CLOSURE_BINARY_PROCS(mul)
+CLOSURE_BINARY_PROCS(div)
+#undef CLOSURE_BINARY_PROCS
+
+enum Closure_Shape {
+    ClosureShape_nn,
+    ClosureShape_nc,
+    ClosureShape_ss,
+    ClosureShape_sc,
+    ClosureShape_cs,
+};
+
+// NOTE(Alexander): indexed by [Binary_Op - Binop_Add][Closure_Shape]
+global Closure_Proc* closure_binary_procs[][5] = {
+#define CLOSURE_BINARY_ROW(name) \
+{ closure_##name##_nn, closure_##name##_nc, closure_##name##_ss, closure_##name##_sc, closure_##name##_cs }
+    CLOSURE_BINARY_ROW(add),
+    CLOSURE_BINARY_ROW(sub),
+    CLOSURE_BINARY_ROW(mul),
+    CLOSURE_BINARY_ROW(div),
+#undef CLOSURE_BINARY_ROW
+};
+
+s32
+closure_slot_index(Closure_Program* program, string_id ident) {
+    smm index = map_get_index(program->slot_indices, ident);
+    if (index != -1) {
+        return program->slot_indices[index].value;
+    }
+    
+    s32 slot = program->slot_count++;
+    map_put(program->slot_indices, ident, slot);
+    return slot;
+}
+
+Closure*
+closure_compile_node(Closure_Program* program, Ast* ast) {
+    Closure* result = arena_push_struct(&program->arena, Closure);
+    *result = {};
+    
+    switch (ast->kind) {
+        case Ast_Value: {
+            result->proc = closure_const;
+            result->lhs_value = ast->Value.integer;
+        } break;
+        
+        case Ast_Ident: {
+            result->proc = closure_slot;
+            result->lhs_value = closure_slot_index(program, ast->Ident);
+        } break;
+        
+        case Ast_Binary: {
+            Ast* lhs = ast->Binary.lhs;
+            Ast* rhs = ast->Binary.rhs;
+            
+            if (ast->Binary.op == Binop_Assign) {
+                if (lhs->kind == Ast_Ident) {
+                    result->lhs_value = closure_slot_index(program, lhs->Ident);
+                    if (rhs->kind == Ast_Value) {
+                        result->proc = closure_assign_slot_const;
+                        result->rhs_value = rhs->Value.integer;
+                    } else if (rhs->kind == Ast_Ident) {
+                        result->proc = closure_assign_slot_slot;
+                        result->rhs_value = closure_slot_index(program, rhs->Ident);
+                    } else {
+                        result->proc = closure_assign_slot_node;
+                        result->rhs = closure_compile_node(program, rhs);
+                    }
+                } else {
+                    result->proc = closure_assign_none;
+                    result->rhs = closure_compile_node(program, rhs);
+                }
+                break;
+            }
+            
+            // NOTE(Alexander): constant fold, except divisions that trap, they are reported at runtime
+            if (lhs->kind == Ast_Value && rhs->kind == Ast_Value &&
+                !(ast->Binary.op == Binop_Div && division_traps(lhs->Value.integer, rhs->Value.integer))) {
+                s32 a = lhs->Value.integer;
+                s32 b = rhs->Value.integer;
+                result->proc = closure_const;
+                switch (ast->Binary.op) {
+                    case Binop_Add: result->lhs_value = a + b; break;
+                    case Binop_Sub: result->lhs_value = a - b; break;
+                    case Binop_Mul: result->lhs_value = a * b; break;
+                    case Binop_Div: result->lhs_value = a / b; break;
+                }
+                break;
+            }
+            
+            Closure_Shape shape = ClosureShape_nn;
+            if (lhs->kind == Ast_Ident && rhs->kind == Ast_Ident) {
+                shape = ClosureShape_ss;
+                result->lhs_value = closure_slot_index(program, lhs->Ident);
+                result->rhs_value = closure_slot_index(program, rhs->Ident);
+            } else if (lhs->kind == Ast_Ident && rhs->kind == Ast_Value) {
+                shape = ClosureShape_sc;
+                result->lhs_value = closure_slot_index(program, lhs->Ident);
+                result->rhs_value = rhs->Value.integer;
+            } else if (lhs->kind == Ast_Value && rhs->kind == Ast_Ident) {
+                shape = ClosureShape_cs;
+                result->lhs_value = lhs->Value.integer;
+                result->rhs_value = closure_slot_index(program, rhs->Ident);
+            } else if (rhs->kind == Ast_Value) {
+                shape = ClosureShape_nc;
+                result->lhs = closure_compile_node(program, lhs);
+                result->rhs_value = rhs->Value.integer;
+            } else {
+                result->lhs = closure_compile_node(program, lhs);
+                result->rhs = closure_compile_node(program, rhs);
+            }
+            
+            assert(ast->Binary.op >= Binop_Add && ast->Binary.op <= Binop_Div);
+            result->proc = closure_binary_procs[ast->Binary.op - Binop_Add][shape];
+        } break;
+        
+        case Ast_Block: {
+            result->proc = closure_block;
+            Closure** last = &result->lhs;
+            for_array_v(ast->Block.exprs, expr, _) {
+                *last = closure_compile_node(program, expr);
+                last = &(*last)->next;
+            }
+        } break;
+        
+        default: {
+            result->proc = closure_const;
+            result->lhs_value = 0;
+        } break;
+    }
+    
+    return result;
+}
+
+void
+closure_compile(Closure_Program* program, Ast* ast) {
+    program->root = closure_compile_node(program, ast);
+}
+
+// NOTE(Alexander): slots has to hold program->slot_count values, zero them
+// to get the same result as a fresh interpreter scope.
+inline s32
+closure_execute(Closure_Program* program, s32* slots) {
+    closure_runtime_error = 0;
+    s32 result = program->root->proc(program->root, slots);
+    program->runtime_error = closure_runtime_error;
+    return program->runtime_error ? 0 : result;
+}
+
+void
+closure_free(Closure_Program* program) {
+    arena_free_all(&program->arena);
+    map_free(program->slot_indices);
+    *program = {};
+}
@@ -0,0 +1,285 @@
+
+// Ahead-of-time output, writes the assembled x64 code to an ELF64 file so a
+// program can be compiled once and shipped without paying for the compile
+// at startup.
+//
+// elf_write_object writes a relocatable object with the code in .text and
+// one global function symbol, it can be linked into a C program:
+//     extern int program_main(int x, int y); // free variables, see program_find_parameter
+// The code doesn't reference any absolute address so there are no relocations.
+//
+// elf_write_executable writes a minimal static executable, a single segment
+// with a _start stub that calls the code with every free variable set to
+// zero (same as the JIT run) and passes the result to the exit syscall, so
+// only the low 8 bits of the result end up in the exit code.
+//
+// The code uses the calling convention of the platform the compiler was
+// built for, the files are only useful when that is the System V ABI.
+
+#if defined(BUILD_POSIX)
+#include <sys/stat.h>
+#endif
+
+#define ELF_DEFAULT_ENTRY_NAME "program_main"
+#define ELF_EXECUTABLE_BASE 0x400000
+
+struct Elf64_Header {
+    u8 ident[16];
+    u16 type;
+    u16 machine;
+    u32 version;
+    u64 entry;
+    u64 program_header_offset;
+    u64 section_header_offset;
+    u32 flags;
+    u16 header_size;
+    u16 program_header_size;
+    u16 program_header_count;
+    u16 section_header_size;
+    u16 section_header_count;
+    u16 section_names_index; // section that holds the section names
+};
+
+struct Elf64_Program_Header {
+    u32 type;
+    u32 flags;
+    u64 offset;
+    u64 virtual_address;
+    u64 physical_address;
+    u64 file_size;
+    u64 memory_size;
+    u64 alignment;
+};
+
+struct Elf64_Section_Header {
+    u32 name; // offset in .shstrtab
+    u32 type;
+    u64 flags;
+    u64 address;
+    u64 offset;
+    u64 size;
+    u32 link;
+    u32 info;
+    u64 alignment;
+    u64 entry_size;
+};
+
+struct Elf64_Symbol {
+    u32 name; // offset in .strtab
+    u8 info;  // binding << 4 | type
+    u8 other;
+    u16 section_index;
+    u64 value;
+    u64 size;
+};
+
+#define ELF_TYPE_RELOCATABLE 1
+#define ELF_TYPE_EXECUTABLE 2
+#define ELF_MACHINE_X86_64 62
+
+#define ELF_SEGMENT_LOAD 1
+#define ELF_SEGMENT_EXECUTE 1
+#define ELF_SEGMENT_READ 4
+
+#define ELF_SECTION_PROGBITS 1
+#define ELF_SECTION_SYMTAB 2
+#define ELF_SECTION_STRTAB 3
+#define ELF_SECTION_ALLOC 2
+#define ELF_SECTION_EXECINSTR 4
+
+#define ELF_SYMBOL_GLOBAL 1
+#define ELF_SYMBOL_FUNC 2
+
+inline void
+elf_push(array(u8)** buffer, void* data, umm size) {
+    smm count = array_count(*buffer);
+    array_set_count(*buffer, count + size);
+    memcpy(*buffer + count, data, size);
+}
+
+// NOTE(Alexander): code is padded with int3 so stray jumps trap, everything else with zeros
+inline void
+elf_align(array(u8)** buffer, umm alignment, u8 padding=0) {
+    while (array_count(*buffer) % alignment != 0) {
+        array_push(*buffer, padding);
+    }
+}
+
+inline u32
+elf_push_string(array(u8)** strings, cstring name) {
+    u32 result = (u32) array_count(*strings);
+    elf_push(strings, (void*) name, strlen(name) + 1);
+    return result;
+}
+
+Elf64_Header
+elf_header(u16 type) {
+    Elf64_Header result = {};
+    u8 ident[] = { 0x7F, 'E', 'L', 'F', 2 /* 64-bit */, 1 /* little endian */, 1 /* version */ };
+    memcpy(result.ident, ident, sizeof(ident));
+    result.type = type;
+    result.machine = ELF_MACHINE_X86_64;
+    result.version = 1;
+    result.header_size = sizeof(Elf64_Header);
+    return result;
+}
+
+bool
+elf_write_file(cstring filepath, array(u8)* buffer, bool is_executable) {
+    FILE* file = fopen(filepath, "wb");
+    if (!file) {
+        return false;
+    }
+    bool result = fwrite(buffer, 1, array_count(buffer), file) == (umm) array_count(buffer);
+    fclose(file);
+    
+#if defined(BUILD_POSIX)
+    if (result && is_executable) {
+        chmod(filepath, 0755);
+    }
+#endif
+    return result;
+}
+
+// NOTE(Alexander): sections are null, .text, .symtab, .strtab, .shstrtab and an empty
+// .note.GNU-stack that tells the linker the code doesn't need an executable stack
+bool
+elf_write_object(cstring filepath, Machine_Code code, cstring entry_name=ELF_DEFAULT_ENTRY_NAME) {
+    array(u8)* buffer = 0;
+    array(u8)* strings = 0;
+    array(u8)* section_names = 0;
+    array_push(strings, 0);
+    array_push(section_names, 0);
+    
+    Elf64_Header header = elf_header(ELF_TYPE_RELOCATABLE);
+    elf_push(&buffer, &header, sizeof(header));
+    
+    Elf64_Section_Header sections[6] = {};
+    Elf64_Section_Header* text = &sections[1];
+    text->name = elf_push_string(&section_names, ".text");
+    text->type = ELF_SECTION_PROGBITS;
+    text->flags = ELF_SECTION_ALLOC | ELF_SECTION_EXECINSTR;
+    text->alignment = 16;
+    elf_align(&buffer, 16);
+    text->offset = array_count(buffer);
+    text->size = code.size;
+    elf_push(&buffer, code.bytes, code.size);
+    
+    Elf64_Symbol symbols[2] = {};
+    symbols[1].name = elf_push_string(&strings, entry_name);
+    symbols[1].info = (ELF_SYMBOL_GLOBAL << 4) | ELF_SYMBOL_FUNC;
+    symbols[1].section_index = 1;
+    symbols[1].size = code.size;
+    
+    Elf64_Section_Header* symtab = &sections[2];
+    symtab->name = elf_push_string(&section_names, ".symtab");
+    symtab->type = ELF_SECTION_SYMTAB;
+    symtab->link = 3;
+    symtab->info = 1; // index of the first global symbol
+    symtab->alignment = 8;
+    symtab->entry_size = sizeof(Elf64_Symbol);
+    elf_align(&buffer, 8);
+    symtab->offset = array_count(buffer);
+    symtab->size = sizeof(symbols);
+    elf_push(&buffer, symbols, sizeof(symbols));
+    
+    Elf64_Section_Header* strtab = &sections[3];
+    strtab->name = elf_push_string(&section_names, ".strtab");
+    strtab->type = ELF_SECTION_STRTAB;
+    strtab->alignment = 1;
+    strtab->offset = array_count(buffer);
+    strtab->size = array_count(strings);
+    elf_push(&buffer, strings, array_count(strings));
+    
+    Elf64_Section_Header* stack_note = &sections[5];
+    stack_note->name = elf_push_string(&section_names, ".note.GNU-stack");
+    stack_note->type = ELF_SECTION_PROGBITS;
+    stack_note->alignment = 1;
+    stack_note->offset = array_count(buffer);
+    
+    Elf64_Section_Header* shstrtab = &sections[4];
+    shstrtab->name = elf_push_string(&section_names, ".shstrtab");
+    shstrtab->type = ELF_SECTION_STRTAB;
+    shstrtab->alignment = 1;
+    shstrtab->offset = array_count(buffer);
+    shstrtab->size = array_count(section_names);
+    elf_push(&buffer, section_names, array_count(section_names));
+    
+    elf_align(&buffer, 8);
+    Elf64_Header* result_header = (Elf64_Header*) buffer;
+    result_header->section_header_offset = array_count(buffer);
+    result_header->section_header_size = sizeof(Elf64_Section_Header);
+    result_header->section_header_count = fixed_array_count(sections);
+    result_header->section_names_index = 4;
+    elf_push(&buffer, sections, sizeof(sections));
+    
+    bool result = elf_write_file(filepath, buffer, false);
+    array_free(buffer);
+    array_free(strings);
+    array_free(section_names);
+    return result;
+}
+
+// NOTE(Alexander): the whole file is loaded as one read+exec segment, the headers are
+// followed by the _start stub and then the code. The stub calls the code with every one of
+// its parameter_count arguments set to zero.
+bool
+elf_write_executable(cstring filepath, Machine_Code code, s32 parameter_count) {
+    array(u8)* buffer = 0;
+    Elf64_Header header = elf_header(ELF_TYPE_EXECUTABLE);
+    header.program_header_offset = sizeof(Elf64_Header);
+    header.program_header_size = sizeof(Elf64_Program_Header);
+    header.program_header_count = 1;
+    elf_push(&buffer, &header, sizeof(header));
+    
+    Elf64_Program_Header segment = {};
+    elf_push(&buffer, &segment, sizeof(segment));
+    
+    // NOTE(Alexander): rsp is 16 byte aligned at _start, one zero is pushed for every argument
+    // after the 6th and the count is rounded up to even to keep it aligned for the call
+    umm start_offset = array_count(buffer);
+    umm stack_count = parameter_count > 6 ? (umm) parameter_count - 6 : 0;
+    umm push_count = align_forward(stack_count, 2);
+    u8 push_zero[] = { 0x6A, 0x00 }; // push 0
+    for (umm push_index = 0; push_index < push_count; push_index++) {
+        elf_push(&buffer, push_zero, sizeof(push_zero));
+    }
+    
+    u8 start_stub[] = {
+        0x31, 0xFF,                   // xor edi, edi
+        0x31, 0xF6,                   // xor esi, esi
+        0x31, 0xD2,                   // xor edx, edx
+        0x31, 0xC9,                   // xor ecx, ecx
+        0x45, 0x31, 0xC0,             // xor r8d, r8d
+        0x45, 0x31, 0xC9,             // xor r9d, r9d
+        0xE8, 0x00, 0x00, 0x00, 0x00, // call code
+        0x89, 0xC7,                   // mov edi, eax
+        0xB8, 0x3C, 0x00, 0x00, 0x00, // mov eax, 60 (exit)
+        0x0F, 0x05,                   // syscall
+    };
+    const umm call_end = 19;
+    umm stub_offset = array_count(buffer);
+    umm code_offset = align_forward(stub_offset + sizeof(start_stub), 16);
+    s32 displacement = (s32) (code_offset - (stub_offset + call_end));
+    memcpy(start_stub + call_end - 4, &displacement, 4);
+    elf_push(&buffer, start_stub, sizeof(start_stub));
+    
+    elf_align(&buffer, 16, 0xCC);
+    assert(array_count(buffer) == code_offset);
+    elf_push(&buffer, code.bytes, code.size);
+    
+    Elf64_Header* result_header = (Elf64_Header*) buffer;
+    result_header->entry = ELF_EXECUTABLE_BASE + start_offset;
+    Elf64_Program_Header* result_segment = (Elf64_Program_Header*) (buffer + sizeof(Elf64_Header));
+    result_segment->type = ELF_SEGMENT_LOAD;
+    result_segment->flags = ELF_SEGMENT_READ | ELF_SEGMENT_EXECUTE;
+    result_segment->virtual_address = ELF_EXECUTABLE_BASE;
+    result_segment->physical_address = ELF_EXECUTABLE_BASE;
+    result_segment->file_size = array_count(buffer);
+    result_segment->memory_size = array_count(buffer);
+    result_segment->alignment = 0x1000;
+    
+    bool result = elf_write_file(filepath, buffer, true);
+    array_free(buffer);
+    return result;
+}
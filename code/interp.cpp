@@ -6,8 +6,18 @@ struct Interp_Scope {
 
 struct Interp {
     array(Interp_Scope)* scopes;
+    cstring runtime_error; // set when a division trapped, callers take 0 as the result of the run then
 };
 
+#define RUNTIME_ERROR_DIVISION "integer division by zero or overflow"
+
+// NOTE(Alexander): idiv traps on these, the other backends check for them before dividing
+// and report the same error instead of crashing
+inline bool
+division_traps(int lhs, int rhs) {
+    return rhs == 0 || (lhs == S32_MIN && rhs == -1);
+}
+
 void
 interp_save_value(Interp* interp, string_id ident, Value value) {
     assert(array_count(interp->scopes) > 0);
@@ -22,6 +32,24 @@ interp_load_value(Interp* interp, string_id ident) {
     return map_get(current_scope->locals, ident);
 }
 
+// NOTE(Alexander): the bytecode constant folder evaluates with this too, so it gives the same results,
+// a division that traps gives 0, see division_traps
+inline int
+interp_binary_integer(Binary_Op op, int lhs, int rhs) {
+    switch (op) {
+#define BINARY_INT_CASE(binop, op_symbol) \
+case Binop_##binop: return lhs op_symbol rhs
+        
+        BINARY_INT_CASE(Add, +);
+        BINARY_INT_CASE(Sub, -);
+        BINARY_INT_CASE(Mul, *);
+#undef BINARY_INT_CASE
+        
+        case Binop_Div: return division_traps(lhs, rhs) ? 0 : lhs / rhs;
+    }
+    return 0;
+}
+
 Value 
 interp_expression(Interp* interp, Ast* ast) {
     Value result = {};
@@ -48,19 +76,11 @@ interp_expression(Interp* interp, Ast* ast) {
                     interp_save_value(interp, ident, rhs_op);
                 }
             } else {
-                switch (ast->Binary.op) {
-#define BINARY_INT_CASE(binop, op_symbol) \
-case Binop_##binop: { \
-result.type = Value_integer; \
-result.integer = lhs_op.integer op_symbol rhs_op.integer; \
-} break
-                    
-                    BINARY_INT_CASE(Add, +);
-                    BINARY_INT_CASE(Sub, -);
-                    BINARY_INT_CASE(Mul, *);
-                    BINARY_INT_CASE(Div, /);
-#undef BINARY_INT_CASE
+                if (ast->Binary.op == Binop_Div && division_traps(lhs_op.integer, rhs_op.integer)) {
+                    interp->runtime_error = RUNTIME_ERROR_DIVISION;
                 }
+                result.type = Value_integer;
+                result.integer = interp_binary_integer(ast->Binary.op, lhs_op.integer, rhs_op.integer);
             }
         } break;
         
@@ -0,0 +1,260 @@
+
+// Liveness analysis, shared by the bytecode and the x64 backend.
+//
+// Instructions are first turned into Live_Operands (the registers each one
+// defines and uses), then the live sets are computed by backward dataflow
+// over the blocks of the program using dense bitsets, one bit per register.
+// Neither the bytecode nor the x64 code have branches yet so they are a
+// single block, but the dataflow iterates to a fixed point over the block
+// successors so it keeps working once there is control flow.
+//
+// Live sets are only stored per block. Within a block liveness is given by
+// the live interval of each register: the first definition to the last use.
+// Everything is linear in the number of instructions plus the size of the
+// bitsets, so it scales to programs with millions of instructions.
+
+#define LIVE_MAX_DEFS 1
+#define LIVE_MAX_USES 3
+#define LIVE_MAX_SUCCESSORS 2
+
+struct Live_Operands {
+    u32 defs[LIVE_MAX_DEFS];
+    u32 uses[LIVE_MAX_USES];
+    u8 def_count;
+    u8 use_count;
+};
+
+struct Live_Block {
+    s32 first; // index of the first instruction
+    s32 last;  // index of the last instruction, inclusive
+    s32 successors[LIVE_MAX_SUCCESSORS];
+    s32 successor_count;
+    
+    u64* live_in;
+    u64* live_out;
+};
+
+struct Live_Interval {
+    s32 start; // first definition, -1 if the register is never used
+    s32 end;   // last use, or the definition if it's never used
+};
+
+struct Liveness {
+    u32 register_count;
+    u32 word_count; // u64 words per bitset
+    
+    array(Live_Block)* blocks;
+    u64* bitsets; // live_in and live_out of every block, plus the use and def sets
+    
+    Live_Interval* intervals; // register_count intervals, indexed by register
+    s32 max_live; // the most registers that are live at the same time
+};
+
+inline u32
+live_count_trailing_zeros(u64 word) {
+#if defined(_MSC_VER)
+    unsigned long result;
+    _BitScanForward64(&result, word);
+    return (u32) result;
+#else
+    return (u32) __builtin_ctzll(word);
+#endif
+}
+
+inline bool
+live_bit_is_set(u64* bitset, u32 reg) {
+    return (bitset[reg >> 6] >> (reg & 63)) & 1;
+}
+
+inline void
+live_bit_set(u64* bitset, u32 reg) {
+    bitset[reg >> 6] |= 1ull << (reg & 63);
+}
+
+inline void
+live_bit_clear(u64* bitset, u32 reg) {
+    bitset[reg >> 6] &= ~(1ull << (reg & 63));
+}
+
+inline void
+live_add_use(Live_Operands* operands, u32 reg) {
+    assert(operands->use_count < LIVE_MAX_USES);
+    operands->uses[operands->use_count++] = reg;
+}
+
+inline void
+live_add_def(Live_Operands* operands, u32 reg) {
+    assert(operands->def_count < LIVE_MAX_DEFS);
+    operands->defs[operands->def_count++] = reg;
+}
+
+// NOTE(Alexander): iterates the set bits of a bitset one word at a time, zero words are skipped
+#define for_live_bits(bitset, word_count, reg) \
+for (u32 _word_index = 0; _word_index < (word_count); _word_index++) \
+for (u64 _word = (bitset)[_word_index]; _word; _word &= _word - 1) \
+for (u32 reg = (_word_index << 6) + live_count_trailing_zeros(_word), _once = 1; _once; _once = 0)
+
+inline void
+live_extend_end(Live_Interval* interval, s32 index) {
+    interval->end = max(interval->end, index);
+}
+
+inline void
+live_extend_start(Live_Interval* interval, s32 index) {
+    interval->start = interval->start < 0 ? index : min(interval->start, index);
+}
+
+// NOTE(Alexander): computes live_in and live_out of every block, then the live intervals.
+// The blocks have to be in program order and cover every instruction.
+void
+liveness_compute(Liveness* liveness, Live_Operands* operands, array(Live_Block)* blocks, u32 register_count) {
+    u32 word_count = (max(register_count, 1) + 63) / 64;
+    smm block_count = array_count(blocks);
+    liveness->register_count = register_count;
+    liveness->word_count = word_count;
+    liveness->blocks = blocks;
+    liveness->bitsets = (u64*) calloc((umm) max(block_count, 1)*4*word_count, sizeof(u64));
+    liveness->intervals = (Live_Interval*) malloc((umm) max(register_count, 1)*sizeof(Live_Interval));
+    liveness->max_live = 0;
+    for (u32 reg = 0; reg < register_count; reg++) {
+        liveness->intervals[reg].start = -1;
+        liveness->intervals[reg].end = -1;
+    }
+    
+    // NOTE(Alexander): use is the registers read before they are written in the block,
+    // def is every register written in the block
+    u64* uses = liveness->bitsets + (umm) 2*block_count*word_count;
+    u64* defs = uses + (umm) block_count*word_count;
+    for_array(blocks, block, block_index) {
+        block->live_in = liveness->bitsets + (umm) 2*block_index*word_count;
+        block->live_out = block->live_in + word_count;
+        u64* block_uses = uses + (umm) block_index*word_count;
+        u64* block_defs = defs + (umm) block_index*word_count;
+        for (s32 i = block->first; i <= block->last; i++) {
+            Live_Operands* op = operands + i;
+            for (int use_index = 0; use_index < op->use_count; use_index++) {
+                if (!live_bit_is_set(block_defs, op->uses[use_index])) {
+                    live_bit_set(block_uses, op->uses[use_index]);
+                }
+            }
+            for (int def_index = 0; def_index < op->def_count; def_index++) {
+                live_bit_set(block_defs, op->defs[def_index]);
+            }
+        }
+    }
+    
+    // NOTE(Alexander): live_out = union of the successors live_in, live_in = use | (live_out & ~def),
+    // visiting the blocks backwards converges in one pass when there are no loops
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (smm block_index = block_count - 1; block_index >= 0; block_index--) {
+            Live_Block* block = blocks + block_index;
+            u64* block_uses = uses + (umm) block_index*word_count;
+            u64* block_defs = defs + (umm) block_index*word_count;
+            for (u32 word = 0; word < word_count; word++) {
+                u64 live_out = 0;
+                for (s32 successor_index = 0; successor_index < block->successor_count; successor_index++) {
+                    live_out |= blocks[block->successors[successor_index]].live_in[word];
+                }
+                u64 live_in = block_uses[word] | (live_out & ~block_defs[word]);
+                changed = changed || live_in != block->live_in[word];
+                block->live_out[word] = live_out;
+                block->live_in[word] = live_in;
+            }
+        }
+    }
+    
+    // NOTE(Alexander): intervals, each block is walked backwards starting from its live_out
+    u64* live = (u64*) malloc(word_count*sizeof(u64));
+    for_array(blocks, block, interval_block_index) {
+        memcpy(live, block->live_out, word_count*sizeof(u64));
+        s32 live_count = 0;
+        for_live_bits(live, word_count, reg) {
+            live_extend_end(&liveness->intervals[reg], block->last);
+            live_count++;
+        }
+        liveness->max_live = max(liveness->max_live, live_count);
+        
+        for (s32 i = block->last; i >= block->first; i--) {
+            Live_Operands* op = operands + i;
+            for (int def_index = 0; def_index < op->def_count; def_index++) {
+                u32 reg = op->defs[def_index];
+                live_extend_start(&liveness->intervals[reg], i);
+                live_extend_end(&liveness->intervals[reg], i);
+                if (live_bit_is_set(live, reg)) {
+                    live_bit_clear(live, reg);
+                    live_count--;
+                }
+            }
+            for (int use_index = 0; use_index < op->use_count; use_index++) {
+                u32 reg = op->uses[use_index];
+                if (!live_bit_is_set(live, reg)) {
+                    live_bit_set(live, reg);
+                    live_extend_end(&liveness->intervals[reg], i);
+                    live_count++;
+                }
+            }
+            liveness->max_live = max(liveness->max_live, live_count);
+        }
+        
+        for_live_bits(live, word_count, reg) {
+            live_extend_start(&liveness->intervals[reg], block->first);
+        }
+    }
+    free(live);
+}
+
+// NOTE(Alexander): the whole program is one block, there are no branches yet
+void
+liveness_compute_straight_line(Liveness* liveness, Live_Operands* operands, smm count, u32 register_count) {
+    array(Live_Block)* blocks = 0;
+    Live_Block block = {};
+    block.first = 0;
+    block.last = (s32) count - 1;
+    array_push(blocks, block);
+    liveness_compute(liveness, operands, blocks, register_count);
+}
+
+inline bool
+liveness_is_live_after(Liveness* liveness, u32 reg, s32 index) {
+    Live_Interval interval = liveness->intervals[reg];
+    return interval.start >= 0 && interval.start <= index && index < interval.end;
+}
+
+void
+liveness_free(Liveness* liveness) {
+    array_free(liveness->blocks);
+    free(liveness->bitsets);
+    free(liveness->intervals);
+    *liveness = {};
+}
+
+void
+bc_live_operands(Bc_Instruction* insn, Live_Operands* result) {
+    *result = {};
+    if (insn->src0.kind == BcOperand_Register) live_add_use(result, insn->src0.Register);
+    if (insn->src1.kind == BcOperand_Register) live_add_use(result, insn->src1.Register);
+    if (insn->dest.kind == BcOperand_Register) live_add_def(result, insn->dest.Register);
+}
+
+Liveness
+bc_compute_liveness(array(Bc_Instruction)* instructions, u32 register_count) {
+    smm count = array_count(instructions);
+    Live_Operands* operands = (Live_Operands*) malloc((umm) max(count, 1)*sizeof(Live_Operands));
+    for_array(instructions, insn, insn_index) {
+        bc_live_operands(insn, operands + insn_index);
+    }
+    
+    Liveness result = {};
+    liveness_compute_straight_line(&result, operands, count, register_count);
+    free(operands);
+    return result;
+}
+
+void
+liveness_print_stats(Liveness* liveness, cstring name, smm instruction_count, f64 seconds) {
+    pln("% liveness: % instructions, % registers, at most % live, % ms", f_cstring(name),
+        f_smm(instruction_count), f_u32(liveness->register_count), f_int(liveness->max_live),
+        f_float(seconds*1e3));
+}
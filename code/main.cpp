@@ -5,15 +5,16 @@
 #include "tokenizer.cpp"
 #include "parser.cpp"
 #include "interp.cpp"
+#include "closure.cpp"
 #include "bytecode.cpp"
+#include "bc_optimize.cpp"
+#include "liveness.cpp"
+#include "bc_compact.cpp"
+#include "vm.cpp"
+#include "batch.cpp"
 #include "x64.cpp"
-
-#if defined(BUILD_WINDOWS)
-#include <windows.h>
-#elif defined(BUILD_POSIX)
-#include <sys/mman.h>
-#include 
-#endif
+#include "elf.cpp"
+#include "program.cpp"
 
 
 string
@@ -49,96 +50,771 @@ parse_source(string source) {
     // Parser
     Parser parser = {};
     parser.tokenizer = &tokenizer;
+    parser.interner = &global_interner;
     Ast* ast = parse_block(&parser);
     
     return ast;
 }
 
-typedef int asm_main(void);
+void
+print_benchmark(cstring name, f64 seconds, int iterations) {
+    f64 ns_per_iteration = seconds*1e9 / (f64) iterations;
+    pln("% % iterations in % ms (% ns/iteration)", f_cstring(name), f_int(iterations),
+        f_float(seconds*1e3), f_float(ns_per_iteration));
+}
+
+// NOTE(Alexander): compiles the source through the embedding API and runs it
+// many times with every variable bound to the iteration index.
+void
+run_api_benchmark(string source, Program_Options* options, int iterations) {
+    Program_Backend backend = options->backend;
+    cstring name = program_backend_names[backend];
+    
+    f64 begin = get_wall_clock_seconds();
+    Program* program = program_compile(source, options);
+    f64 compile_seconds = get_wall_clock_seconds() - begin;
+    if (!program) {
+        return;
+    }
+    
+    s32 var_count = (s32) array_count(program->variables);
+    s64 checksum = 0;
+    int error_count = 0;
+    cstring error = 0;
+    begin = get_wall_clock_seconds();
+    for (int i = 0; i < iterations; i++) {
+        for (s32 var_index = 0; var_index < var_count; var_index++) {
+            program_bind_index(program, var_index, i);
+        }
+        checksum += program_run(program);
+        if (program->runtime_error) {
+            error = program->runtime_error;
+            error_count++;
+        }
+    }
+    f64 seconds = get_wall_clock_seconds() - begin;
+    
+    pln("API %: compiled in % ms, % ns/run, checksum %", f_cstring(name),
+        f_float(compile_seconds*1e3), f_float(seconds*1e9 / (f64) iterations), f_s64(checksum));
+    if (error_count > 0) {
+        pln("error: % of % runs trapped: %", f_int(error_count), f_int(iterations), f_cstring(error));
+    }
+    
+    // NOTE(Alexander): direct calls don't catch traps, so they are only timed if no run trapped
+    if (backend == ProgramBackend_Jit && program->parameter_count <= JIT_CALL_MAX_ARGUMENTS &&
+        error_count == 0) {
+        // NOTE(Alexander): calling the native function directly, every free variable gets i
+        asm_main_args* func = program_function(program, asm_main_args);
+        checksum = 0;
+        begin = get_wall_clock_seconds();
+        for (int i = 0; i < iterations; i++) {
+            checksum += func(i, i, i, i, i, i, i, i);
+        }
+        seconds = get_wall_clock_seconds() - begin;
+        pln("API %: % parameters, % ns/call through program_function, checksum %", f_cstring(name),
+            f_int(program->parameter_count), f_float(seconds*1e9 / (f64) iterations), f_s64(checksum));
+    }
+    
+    if (backend == ProgramBackend_Tiered) {
+        program_print_stats(program);
+    }
+    program_destroy(program);
+}
+
+struct Strength_Case {
+    s32 constant;
+    Bc_Builder bc;
+    Vm vm;
+    s32 slot;
+    asm_main* func;
+};
+
+// NOTE(Alexander): checks that strength reduced multiplies and divides by a constant give
+// exactly the same results as interp_expression, for edge case and random constants and
+// inputs. The reduced bytecode is run by the VM and by the JIT if it's supported, every
+// constant is compiled before the code arena is sealed once.
+void
+check_strength_reduction(int random_count) {
+    array(s32)* constants = 0;
+    for (s32 constant = -1024; constant <= 1024; constant++) {
+        array_push(constants, constant);
+    }
+    for (int shift = 11; shift < 31; shift++) {
+        s32 power = 1 << shift;
+        s32 neighbours[] = { power - 1, power, power + 1, -power + 1, -power, -power - 1 };
+        for (int neighbour_index = 0; neighbour_index < fixed_array_count(neighbours); neighbour_index++) {
+            array_push(constants, neighbours[neighbour_index]);
+        }
+    }
+    array_push(constants, S32_MAX);
+    array_push(constants, S32_MIN);
+    array_push(constants, S32_MIN + 1);
+    
+    u32 random_state = 0x9E3779B9;
+#define NEXT_RANDOM() (random_state ^= random_state << 13, random_state ^= random_state >> 17, \
+random_state ^= random_state << 5, (s32) random_state)
+    for (int random_index = 0; random_index < random_count; random_index++) {
+        array_push(constants, NEXT_RANDOM());
+    }
+    
+    s32 edge_inputs[] = {
+        0, 1, -1, 2, -2, 3, -3, 7, -7, 1000, -1000, 0x40000000, -0x40000000,
+        S32_MAX, S32_MAX - 1, S32_MIN, S32_MIN + 1
+    };
+    
+    cstring sources[] = { "x * 1;", "x / 1;" };
+    s64 check_count = 0;
+    s64 mismatch_count = 0;
+    for (int source_index = 0; source_index < fixed_array_count(sources); source_index++) {
+        Ast* ast = parse_source(string_lit(sources[source_index]));
+        Ast* binary = ast->Block.exprs[0];
+        bool is_divide = binary->Binary.op == Binop_Div;
+        
+        array(Strength_Case)* cases = 0;
+        for_array_v(constants, constant, _) {
+            binary->Binary.rhs->Value.integer = constant;
+            
+            Strength_Case test = {};
+            test.constant = constant;
+            Bc_Builder* bc = &test.bc;
+            bc_build_expression(bc, ast);
+            Bc_Operand x = map_get(bc->locals, binary->Binary.lhs->Ident);
+            
+            Bc_Pass_Manager pass_manager = {};
+            bc_pass_manager_add_pipeline(&pass_manager, 2);
+            array(Bc_Instruction)* optimized = bc_pass_manager_run(&pass_manager, bc->instructions,
+                                                                   &bc->next_free_register);
+            array_free(bc->instructions);
+            bc->instructions = optimized;
+            bc_pass_manager_free(&pass_manager);
+            
+            vm_initialize(&test.vm, bc->instructions, bc->next_free_register);
+            test.slot = vm_find_slot(bc->instructions, x.Register);
+            test.func = jit_compile_unsealed(bc->instructions);
+            array_push(cases, test);
+        }
+        
+        Jit_Code_Arena* arena = jit_get_code_arena();
+        if (arena) {
+            jit_arena_seal(arena);
+        }
+        
+        for_array(cases, test, case_index) {
+            s32 constant = test->constant;
+            Vm* vm = &test->vm;
+            binary->Binary.rhs->Value.integer = constant;
+            
+            for (int input_index = 0; input_index < fixed_array_count(edge_inputs) + random_count; input_index++) {
+                s32 input = (input_index < fixed_array_count(edge_inputs) ?
+                             edge_inputs[input_index] : NEXT_RANDOM());
+                if (is_divide && (constant == 0 || (constant == -1 && input == S32_MIN))) {
+                    continue;
+                }
+                
+                Interp interp = {};
+                Interp_Scope scope = {};
+                Value value = {};
+                value.type = Value_integer;
+                value.integer = input;
+                map_put(scope.locals, binary->Binary.lhs->Ident, value);
+                array_push(interp.scopes, scope);
+                s32 expected = interp_expression(&interp, ast).integer;
+                map_free(interp.scopes[0].locals);
+                array_free(interp.scopes);
+                
+                if (test->slot >= 0) {
+                    vm_bind(vm, test->slot, input);
+                }
+                s32 vm_result = vm_execute(vm, test->bc.instructions, array_count(test->bc.instructions));
+                s32 jit_result = expected;
+                if (test->func) {
+                    s32 jit_arguments[JIT_CALL_MAX_ARGUMENTS] = { input };
+                    jit_result = jit_call(test->func, jit_arguments);
+                }
+                
+                check_count++;
+                if (vm_result != expected || jit_result != expected) {
+                    if (mismatch_count < 10) {
+                        pln("error: % with x = % gives % (VM) and % (JIT), expected %",
+                            f_cstring(sources[source_index]) , f_int(input), f_int(vm_result),
+                            f_int(jit_result), f_int(expected));
+                        pln("    the constant is %", f_int(constant));
+                    }
+                    mismatch_count++;
+                }
+            }
+            
+            jit_free_executable(test->func);
+            vm_free(vm);
+            array_free(test->bc.instructions);
+            map_free(test->bc.locals);
+        }
+        array_free(cases);
+    }
+#undef NEXT_RANDOM
+    
+    pln("Strength reduction: % constants, % checks, % mismatches", f_smm(array_count(constants)),
+        f_s64(check_count), f_s64(mismatch_count));
+    array_free(constants);
+    
+    Jit_Code_Arena* arena = jit_get_code_arena();
+    if (arena) {
+        jit_arena_print_stats(arena);
+    }
+}
+
+struct Column_Argument {
+    cstring name;
+    cstring filepath;
+};
+
+void
+write_column_file(cstring filepath, s32* column, smm row_count) {
+    FILE* file = fopen(filepath, "wb");
+    if (file) {
+        fwrite(column, sizeof(s32), row_count, file);
+        fclose(file);
+    } else {
+        pln("error: could not write `%`", f_cstring(filepath));
+    }
+}
+
+// NOTE(Alexander): runs the program over many rows with the vector-at-a-time VM,
+// variables are bound to columns loaded from files (raw little-endian s32 values)
+// and the remaining variables are zero, same as in the other runs. The result column and the
+// final values of the output column variables are written in the same format.
+void
+run_batch(Ast* ast, Bc_Builder* bc, smm row_count, array(Column_Argument)* column_args, 
+          array(Column_Argument)* output_column_args, cstring output_filepath) {
+    
+    map(string_id, s32*)* columns = 0;
+    for_array(column_args, arg, _) {
+        string data = read_entire_file(arg->filepath);
+        smm count = data.count / sizeof(s32);
+        row_count = row_count > 0 ? min(row_count, count) : count;
+        string_id ident = vars_save_cstring(arg->name);
+        map_put(columns, ident, (s32*) data.data);
+    }
+    
+    if (row_count <= 0) {
+        pln("error: batch mode needs a row count or input columns");
+        map_free(columns);
+        return;
+    }
+    
+    // NOTE(Alexander): a misspelled column would otherwise leave its variable at zero without notice
+    for_array(column_args, arg, input_index) {
+        string_id ident = vars_save_cstring(arg->name);
+        if (!map_key_exists(bc->locals, ident)) {
+            pln("error: `%` is not a variable of the program, its column is not used", f_cstring(arg->name));
+        }
+    }
+    
+    Vm_Batch batch = {};
+    vm_batch_initialize(&batch, bc->instructions, bc->next_free_register);
+    for_map(bc->locals, it) {
+        if (map_key_exists(columns, it->key)) {
+            vm_batch_bind_input(&batch, it->value, map_get(columns, it->key));
+        }
+    }
+    
+    // NOTE(Alexander): variables that are never read are removed by the optimizer (see bc_remove_dead_slots)
+    array(s32*)* output_columns = 0;
+    for_array(output_column_args, arg, output_index) {
+        string_id ident = vars_save_cstring(arg->name);
+        Bc_Operand slot = map_get(bc->locals, ident);
+        bool is_pushed = false;
+        if (map_key_exists(bc->locals, ident)) {
+            for_array(bc->instructions, insn, insn_index) {
+                if (insn->opcode == Bytecode_push && insn->dest.Register == slot.Register) {
+                    is_pushed = true;
+                    break;
+                }
+            }
+        }
+        
+        s32* column = (s32*) calloc(row_count, sizeof(s32));
+        array_push(output_columns, column);
+        if (is_pushed) {
+            vm_batch_bind_output(&batch, slot, column);
+        } else {
+            pln("error: `%` is not a variable of the program or was optimized away, its output column is all zeros",
+                f_cstring(arg->name));
+        }
+    }
+    
+    s32* result = (s32*) malloc(row_count*sizeof(s32));
+    f64 begin = get_wall_clock_seconds();
+    vm_batch_execute(&batch, row_count, result);
+    f64 seconds = get_wall_clock_seconds() - begin;
+    pln("Batch: % rows in % ms (% rows/s)", f_smm(row_count), f_float(seconds*1e3),
+        f_float((f64) row_count / seconds));
+    if (batch.trapped_count > 0) {
+        pln("error: % of % rows trapped (%), their result is 0", f_smm(batch.trapped_count),
+            f_smm(row_count), f_cstring(RUNTIME_ERROR_DIVISION));
+    }
+    
+    // NOTE(Alexander): check a sample of the rows against the interpreter
+    int mismatch_count = 0;
+    for (smm row = 0; row < row_count; row = row < 16 ? row + 1 : max(row + 1, row_count - 1)) {
+        Interp interp = {};
+        Interp_Scope scope = {};
+        for_map(columns, it) {
+            Value value = {};
+            value.type = Value_integer;
+            value.integer = it->value[row];
+            map_put(scope.locals, it->key, value);
+        }
+        array_push(interp.scopes, scope);
+        
+        Value expected = interp_expression(&interp, ast);
+        if (interp.runtime_error) {
+            expected.integer = 0;
+        }
+        if (expected.integer != result[row]) {
+            mismatch_count++;
+        }
+        map_free(interp.scopes[0].locals);
+        array_free(interp.scopes);
+    }
+    if (mismatch_count > 0) {
+        pln("error: batch result does not match the interpreter in % rows", f_int(mismatch_count));
+    }
+    
+    if (output_filepath) {
+        write_column_file(output_filepath, result, row_count);
+    }
+    for_array(output_column_args, arg, column_index) {
+        write_column_file(arg->filepath, output_columns[column_index], row_count);
+        free(output_columns[column_index]);
+    }
+    array_free(output_columns);
+    
+    vm_batch_free(&batch);
+    for_map(columns, it) {
+        free(it->value);
+    }
+    map_free(columns);
+    free(result);
+}
 
 int
 main(int argc, char** argv) {
+    // NOTE(Alexander): usage: compiler <file> [-interp] [-closure] [-vm] [-jit] [-bench <iterations>] [-profile]
+    //                                        [-batch <rows>] [-column <name> <file>] [-output <file>]
+    //                                        [-output-column <name> <file>] [-api]
+    //                                        [-tiered <jit threshold>] [-background] [-O0|-O1|-O2] [-passes <name,...>]
+    //                                        [-check-strength] [-emit-object <file>] [-entry <name>]
+    //                                        [-emit-executable <file>] [-perf-map] [-jitdump]
+    // the backends to run can be selected, by default all of them are run.
+    cstring filepath = 0;
+    b32 use_interp = false;
+    b32 use_closure = false;
+    b32 use_vm = false;
+    b32 use_jit = false;
+    int bench_iterations = 0;
+    b32 profile_vm = false;
+    b32 use_batch = false;
+    smm batch_rows = 0;
+    array(Column_Argument)* column_args = 0;
+    array(Column_Argument)* output_column_args = 0;
+    cstring output_filepath = 0;
+    b32 use_api = false;
+    b32 use_tiered = false;
+    s32 jit_threshold = 0;
+    b32 use_background_jit = false;
+    int optimization_level = 0;
+    cstring pass_list = 0;
+    b32 check_strength = false;
+    cstring object_filepath = 0;
+    cstring executable_filepath = 0;
+    cstring entry_name = ELF_DEFAULT_ENTRY_NAME;
+    u32 perf_flags = 0;
+    
+    for (int arg_index = 1; arg_index < argc; arg_index++) {
+        string arg = string_lit(argv[arg_index]);
+        if (string_equals(arg, string_lit("-interp"))) {
+            use_interp = true;
+        } else if (string_equals(arg, string_lit("-closure"))) {
+            use_closure = true;
+        } else if (string_equals(arg, string_lit("-vm"))) {
+            use_vm = true;
+        } else if (string_equals(arg, string_lit("-jit"))) {
+            use_jit = true;
+        } else if (string_equals(arg, string_lit("-bench")) && arg_index + 1 < argc) {
+            bench_iterations = atoi(argv[++arg_index]);
+        } else if (string_equals(arg, string_lit("-profile"))) {
+            profile_vm = true;
+        } else if (string_equals(arg, string_lit("-batch")) && arg_index + 1 < argc) {
+            use_batch = true;
+            batch_rows = atoll(argv[++arg_index]);
+        } else if (string_equals(arg, string_lit("-column")) && arg_index + 2 < argc) {
+            use_batch = true;
+            Column_Argument column = {};
+            column.name = argv[++arg_index];
+            column.filepath = argv[++arg_index];
+            array_push(column_args, column);
+        } else if (string_equals(arg, string_lit("-output-column")) && arg_index + 2 < argc) {
+            use_batch = true;
+            Column_Argument column = {};
+            column.name = argv[++arg_index];
+            column.filepath = argv[++arg_index];
+            array_push(output_column_args, column);
+        } else if (string_equals(arg, string_lit("-api"))) {
+            use_api = true;
+        } else if (string_equals(arg, string_lit("-tiered")) && arg_index + 1 < argc) {
+            use_api = true;
+            use_tiered = true;
+            jit_threshold = atoi(argv[++arg_index]);
+        } else if (string_equals(arg, string_lit("-background"))) {
+            use_background_jit = true;
+        } else if (string_equals(arg, string_lit("-O0"))) {
+            optimization_level = 0;
+        } else if (string_equals(arg, string_lit("-O1"))) {
+            optimization_level = 1;
+        } else if (string_equals(arg, string_lit("-O2"))) {
+            optimization_level = 2;
+        } else if (string_equals(arg, string_lit("-passes")) && arg_index + 1 < argc) {
+            pass_list = argv[++arg_index];
+        } else if (string_equals(arg, string_lit("-check-strength"))) {
+            check_strength = true;
+        } else if (string_equals(arg, string_lit("-output")) && arg_index + 1 < argc) {
+            output_filepath = argv[++arg_index];
+        } else if (string_equals(arg, string_lit("-emit-object")) && arg_index + 1 < argc) {
+            object_filepath = argv[++arg_index];
+        } else if (string_equals(arg, string_lit("-emit-executable")) && arg_index + 1 < argc) {
+            executable_filepath = argv[++arg_index];
+        } else if (string_equals(arg, string_lit("-entry")) && arg_index + 1 < argc) {
+            entry_name = argv[++arg_index];
+        } else if (string_equals(arg, string_lit("-perf-map"))) {
+            perf_flags |= JitPerf_Map;
+        } else if (string_equals(arg, string_lit("-jitdump"))) {
+            perf_flags |= JitPerf_Dump;
+        } else {
+            filepath = argv[arg_index];
+        }
+    }
     
-    if (argc >= 2) {
-        string source = read_entire_file(argv[1]);
+    if (!use_interp && !use_closure && !use_vm && !use_jit) {
+        use_interp = true;
+        use_closure = true;
+        use_vm = true;
+        use_jit = true;
+    }
+    
+    if (perf_flags) {
+        jit_perf_open(perf_flags, filepath);
+    }
+    
+    if (check_strength) {
+        check_strength_reduction(64);
+    }
+    
+    if (filepath) {
+        string source = read_entire_file(filepath);
         Ast* ast = parse_source(source);
         
-        // Interpreter
+        // Interpreter, this is always run since it's the reference result
         Interp interp = {};
         Interp_Scope scope = {};
         array_push(interp.scopes, scope);
         
+        // NOTE(Alexander): a division that traps is reported instead of crashing, every
+        // backend gives 0 as the result then
         Value interp_result = interp_expression(&interp, ast);
+        if (interp.runtime_error) {
+            interp_result.integer = 0;
+        }
+        
+        // Closure compiler
+        Closure_Program closure_program = {};
+        s32* closure_slots = 0;
+        s32 closure_result = 0;
+        if (use_closure) {
+            closure_compile(&closure_program, ast);
+            closure_slots = (s32*) calloc(max(closure_program.slot_count, 1), sizeof(s32));
+            closure_result = closure_execute(&closure_program, closure_slots);
+        }
         
         // Bytecode builder
         Bc_Builder bc_builder = {};
         bc_build_expression(&bc_builder, ast);
-        bc_print_program(&bc_builder);
         
-        asm_main* func = 0;
+        // Bytecode optimizations, an explicit pass list replaces the -O pipeline
+        Bc_Pass_Manager pass_manager = {};
+        if (pass_list) {
+            bc_pass_manager_add_list(&pass_manager, pass_list);
+        } else {
+            bc_pass_manager_add_pipeline(&pass_manager, optimization_level);
+        }
+        if (array_count(pass_manager.passes) > 0) {
+            array(Bc_Instruction)* optimized = bc_pass_manager_run(&pass_manager, bc_builder.instructions,
+                                                                   &bc_builder.next_free_register);
+            array_free(bc_builder.instructions);
+            bc_builder.instructions = optimized;
+            bc_pass_manager_print_stats(&pass_manager);
+        }
+        bc_pass_manager_free(&pass_manager);
+        bc_print_program(&bc_builder);
         
-#if defined(BUILD_X64)
-        // X64 assembler
-        X64_Builder x64_builder = {};
-        convert_to_x64(&x64_builder, bc_builder.instructions);
+        // Liveness analysis
+        f64 liveness_begin = get_wall_clock_seconds();
+        Liveness bc_liveness = bc_compute_liveness(bc_builder.instructions, bc_builder.next_free_register);
+        liveness_print_stats(&bc_liveness, "Bytecode", array_count(bc_builder.instructions),
+                             get_wall_clock_seconds() - liveness_begin);
+        liveness_free(&bc_liveness);
         
-        pln("Before register allocation:");
-        x64_print_program(&x64_builder);
+        // Compact bytecode encoding
+        Bc_Compact_Program compact = bc_compact_encode(bc_builder.instructions);
+        bc_compact_print_stats(&compact);
+        if (!bc_compact_verify(bc_builder.instructions, &compact)) {
+            pln("error: compact bytecode does not decode to the original program");
+        }
         
-        allocate_x64_registers(x64_builder.instructions);
+        // Bytecode VM
+        Vm vm = {};
+        s32 vm_result = 0;
+        s32 vm_compact_result = 0;
+        s32 vm_fused_result = 0;
+        cstring vm_error = 0;
+        array(Bc_Instruction)* fused = 0;
+        if (use_vm) {
+            vm_initialize(&vm, bc_builder.instructions, bc_builder.next_free_register);
+            vm_result = vm_execute(&vm, bc_builder.instructions, array_count(bc_builder.instructions));
+            vm_error = vm.runtime_error;
+            vm_compact_result = vm_execute_compact(&vm, &compact);
+            
+            fused = bc_fuse_superinstructions(bc_builder.instructions, bc_builder.next_free_register);
+            vm_fused_result = vm_execute(&vm, fused, array_count(fused));
+            
+            if (profile_vm) {
+                Vm_Profile* profile = (Vm_Profile*) calloc(1, sizeof(Vm_Profile));
+                vm_execute_profiled(&vm, bc_builder.instructions, array_count(bc_builder.instructions), profile);
+                vm_print_profile(profile, 10);
+                u64 dispatch_count = profile->dispatch_count;
+                
+                memset(profile, 0, sizeof(Vm_Profile));
+                vm_execute_profiled(&vm, fused, array_count(fused), profile);
+                pln("\nWith superinstructions:");
+                vm_print_profile(profile, 10);
+                pln("Superinstructions removed % of % dispatches\n",
+                    f_u64(dispatch_count - profile->dispatch_count), f_u64(dispatch_count));
+                free(profile);
+            }
+        }
         
-        pln("After register allocation:");
-        x64_print_program(&x64_builder);
+        asm_main* func = 0;
+        s32 jit_arguments[JIT_CALL_MAX_ARGUMENTS] = {}; // free variables start at zero
         
-        Machine_Code code = assemble_to_x64_machine_code(x64_builder.instructions);
-        pln("\nX64 Machine Code (% bytes):", f_umm(code.size));
-        for (int byte_index = 0; byte_index < code.size; byte_index++) {
-            u8 byte = code.bytes[byte_index];
-            if (byte > 0xF) {
-                printf("%hhX ", byte);
-            } else {
-                printf("0%hhX ", byte);
+#if defined(BUILD_X64)
+        if (use_jit) {
+            // X64 assembler
+            X64_Builder x64_builder = {};
+            convert_to_x64(&x64_builder, bc_builder.instructions);
+            
+            pln("Before register allocation:");
+            x64_print_program(&x64_builder);
+            
+            liveness_begin = get_wall_clock_seconds();
+            Liveness x64_liveness = x64_compute_liveness(x64_builder.instructions);
+            liveness_print_stats(&x64_liveness, "X64", array_count(x64_builder.instructions),
+                                 get_wall_clock_seconds() - liveness_begin);
+            liveness_free(&x64_liveness);
+            
+            X64_Allocation_Stats allocation_stats = {};
+            f64 allocation_begin = get_wall_clock_seconds();
+            allocate_x64_registers(&x64_builder, &allocation_stats);
+            x64_print_allocation_stats(&allocation_stats, get_wall_clock_seconds() - allocation_begin);
+            
+            pln("After register allocation:");
+            x64_print_program(&x64_builder);
+            
+            f64 assemble_begin = get_wall_clock_seconds();
+            Machine_Code code = assemble_to_x64_machine_code(x64_builder.instructions);
+            f64 assemble_seconds = get_wall_clock_seconds() - assemble_begin;
+            smm assembled_count = array_count(x64_builder.instructions);
+            pln("Assembled % instructions in % ms (% million instructions/s)", f_smm(assembled_count),
+                f_float(assemble_seconds*1e3), f_float((f64) assembled_count / max(assemble_seconds, 1e-9) / 1e6));
+            Machine_Code long_code = assemble_to_x64_machine_code(x64_builder.instructions, false);
+            pln("\nX64 Machine Code (% bytes, % bytes without the short encodings):",
+                f_umm(code.size), f_umm(long_code.size));
+            free(long_code.bytes);
+            array_free(long_code.lines);
+            for (int byte_index = 0; byte_index < code.size; byte_index++) {
+                u8 byte = code.bytes[byte_index];
+                if (byte > 0xF) {
+                    printf("%hhX ", byte);
+                } else {
+                    printf("0%hhX ", byte);
+                }
+                
+                if (byte_index % 16 == 15) {
+                    printf("\n");
+                }
             }
             
-            if (byte_index % 16 == 15) {
-                printf("\n");
+            // Ahead-of-time output
+            s32 parameter_count = (s32) array_count(x64_builder.parameters);
+            if (object_filepath) {
+                if (elf_write_object(object_filepath, code, entry_name)) {
+                    pln("\nWrote object `%` with entry symbol `%`", f_cstring(object_filepath), f_cstring(entry_name));
+                } else {
+                    pln("\nerror: could not write `%`", f_cstring(object_filepath));
+                }
             }
+            if (executable_filepath) {
+                if (elf_write_executable(executable_filepath, code, parameter_count)) {
+                    pln("\nWrote executable `%`", f_cstring(executable_filepath));
+                } else {
+                    pln("\nerror: could not write `%`", f_cstring(executable_filepath));
+                }
+            }
+            
+            // Run the code JIT
+            if (parameter_count > JIT_CALL_MAX_ARGUMENTS) {
+                pln("\nerror: the JIT can only run programs with up to % free variables, the program has %",
+                    f_int(JIT_CALL_MAX_ARGUMENTS), f_int(parameter_count));
+            } else {
+                func = jit_allocate_executable(code);
+                if (!func) {
+                    pln("Failed to run X64 JIT, BUILD_WINDOWS or BUILD_POSIX needs to be defined");
+                }
+            }
+            
         }
+#endif // #ifdef BUILD_X64
         
-        // Run the code JIT
-#if defined(BUILD_WINDOWS)
-        u32 asm_buffer_size = code.size + 1024;
-        void* asm_buffer = VirtualAlloc(0, asm_buffer_size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-        memcpy(asm_buffer, code.bytes, code.size);
-        DWORD prev_protect = 0;
-        VirtualProtect(asm_buffer, asm_buffer_size, PAGE_EXECUTE_READ, &prev_protect);
-        func = (asm_main*) asm_buffer;
+        pln("\n");
+        if (interp.runtime_error) {
+            pln("error: interpreter trapped: %", f_cstring(interp.runtime_error));
+        } else {
+            pln("Interpreter exited with code %", f_int(interp_result.integer));
+        }
         
-#elif defined(BUILD_POSIX)
-        u32 asm_buffer_size = code.size + 1024;
+        if (use_closure) {
+            if (closure_program.runtime_error) {
+                pln("error: closure trapped: %", f_cstring(closure_program.runtime_error));
+            } else {
+                pln("    Closure exited with code %", f_int(closure_result));
+            }
+            if (closure_result != interp_result.integer) {
+                pln("error: closure result does not match the interpreter");
+            }
+        }
         
-        void* asm_buffer = 0;
-        posix_memalign(&asm_buffer, 4096, asm_buffer_size);
-        mprotect(asm_buffer, size, PROT_READ | PROT_WRITE);
-        memset(asm_buffer, 0, asm_buffer_size);
-        memcpy(asm_buffer, code.bytes, code.size);
-        mprotect(asm_buffer, size, PROT_READ | PROT_EXEC);
-        func = (asm_main*) asm_buffer;
-#endif
+        if (use_vm) {
+            if (vm_error) {
+                pln("error: VM trapped: %", f_cstring(vm_error));
+            } else {
+                pln("         VM exited with code %", f_int(vm_result));
+            }
+            if (vm_result != interp_result.integer ||
+                vm_compact_result != interp_result.integer ||
+                vm_fused_result != interp_result.integer) {
+                pln("error: VM result does not match the interpreter");
+            }
+        }
         
-        if (!func) {
-            pln("Failed to run X64 JIT, BUILD_WINDOWS or BUILD_POSIX needs to be defined");
+        if (func) {
+            s32 jit_exit_code;
+            cstring error = jit_call_checked(func, jit_arguments, &jit_exit_code);
+            if (error) {
+                pln("error: JIT trapped: %", f_cstring(error));
+                func = 0;
+            } else {
+                pln("        JIT exited with code %", f_int(jit_exit_code));
+            }
         }
         
-#endif // #ifdef BUILD_X64
+        if (bench_iterations > 0) {
+            pln("\nBenchmark:");
+            if (use_interp) {
+                f64 begin = get_wall_clock_seconds();
+                for (int i = 0; i < bench_iterations; i++) {
+                    interp_expression(&interp, ast);
+                }
+                print_benchmark("Interpreter", get_wall_clock_seconds() - begin, bench_iterations);
+            }
+            
+            if (use_closure) {
+                f64 begin = get_wall_clock_seconds();
+                for (int i = 0; i < bench_iterations; i++) {
+                    closure_execute(&closure_program, closure_slots);
+                }
+                print_benchmark("    Closure", get_wall_clock_seconds() - begin, bench_iterations);
+            }
+            
+            if (use_vm) {
+                smm count = array_count(bc_builder.instructions);
+                f64 begin = get_wall_clock_seconds();
+                for (int i = 0; i < bench_iterations; i++) {
+                    vm_execute(&vm, bc_builder.instructions, count);
+                }
+                print_benchmark("         VM", get_wall_clock_seconds() - begin, bench_iterations);
+                
+                begin = get_wall_clock_seconds();
+                for (int i = 0; i < bench_iterations; i++) {
+                    vm_execute_compact(&vm, &compact);
+                }
+                print_benchmark(" VM compact", get_wall_clock_seconds() - begin, bench_iterations);
+                
+                smm fused_count = array_count(fused);
+                begin = get_wall_clock_seconds();
+                for (int i = 0; i < bench_iterations; i++) {
+                    vm_execute(&vm, fused, fused_count);
+                }
+                print_benchmark("   VM fused", get_wall_clock_seconds() - begin, bench_iterations);
+            }
+            
+            if (func) {
+                f64 begin = get_wall_clock_seconds();
+                for (int i = 0; i < bench_iterations; i++) {
+                    jit_call(func, jit_arguments);
+                }
+                print_benchmark("        JIT", get_wall_clock_seconds() - begin, bench_iterations);
+            }
+        }
         
-        pln("\n\nInterpreter exited with code %", f_int(interp_result.integer));
-        if (func) {
-            int jit_exit_code = (int) func();
-            pln("        JIT exited with code %", f_int(jit_exit_code));
+        if (use_api) {
+            int iterations = max(bench_iterations, 1);
+            pln("");
+            Jit_Queue jit_queue = {};
+            Program_Options options = {};
+            options.jit_threshold = jit_threshold;
+            options.optimization_level = optimization_level;
+            options.passes = pass_list;
+            if (use_background_jit) {
+                jit_queue_start(&jit_queue);
+                options.jit_queue = &jit_queue;
+            }
+            for (int backend = 0; backend <= ProgramBackend_Tiered; backend++) {
+                options.backend = (Program_Backend) backend;
+                if ((backend == ProgramBackend_Interp && use_interp) ||
+                    (backend == ProgramBackend_Closure && use_closure) ||
+                    (backend == ProgramBackend_Vm && use_vm) ||
+                    (backend == ProgramBackend_Jit && use_jit) ||
+                    (backend == ProgramBackend_Tiered && use_tiered)) {
+                    run_api_benchmark(source, &options, iterations);
+                }
+            }
+            
+            if (use_background_jit) {
+                jit_queue_stop(&jit_queue);
+            }
         }
         
-    } else {
+        if (use_batch) {
+            pln("");
+            run_batch(ast, &bc_builder, batch_rows, column_args, output_column_args, output_filepath);
+        }
+        
+        closure_free(&closure_program);
+        free(closure_slots);
+        vm_free(&vm);
+        array_free(fused);
+        bc_compact_free(&compact);
+        
+    } else if (!check_strength) {
         
         // Run interpreter in a REPL
         Interp interp = {};
@@ -158,7 +834,10 @@ main(int argc, char** argv) {
             
             Ast* ast = parse_source(source);
             Value interp_result = interp_expression(&interp, ast);
-            if (interp_result.type == Value_integer) {
+            if (interp.runtime_error) {
+                pln("error: %", f_cstring(interp.runtime_error));
+                interp.runtime_error = 0;
+            } else if (interp_result.type == Value_integer) {
                 pln("= %", f_int(interp_result.integer));
             }
             
@@ -166,5 +845,7 @@ main(int argc, char** argv) {
             free(input);
         }
     }
+    
+    jit_perf_close();
 }
 
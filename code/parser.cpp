@@ -1,14 +1,35 @@
 
 // Parser
 
+struct String_Interner;
+
 struct Parser {
     Tokenizer* tokenizer;
     Token curr_token;
     Token peek_token;
     
     Memory_Arena ast_arena;
+    String_Interner* interner;
+    
+    u8* line_cursor; // newlines before this position are counted in line
+    u32 line;
 };
 
+// NOTE(Alexander): 1-based, positions have to be passed in increasing order
+u32
+parser_line_at(Parser* parser, u8* position) {
+    if (!parser->line_cursor) {
+        parser->line_cursor = parser->tokenizer->start;
+        parser->line = 1;
+    }
+    for (; parser->line_cursor < position; parser->line_cursor++) {
+        if (*parser->line_cursor == '\n') {
+            parser->line++;
+        }
+    }
+    return parser->line;
+}
+
 Token
 next_token(Parser* parser) {
     if (parser->peek_token.kind != Token_Invalid) {
@@ -50,16 +71,49 @@ struct String_Interner {
 global String_Interner global_interner;
 
 string_id
-vars_save_cstring(cstring s) {
-    string_id id = string_map_get(global_interner.str_to_id, s);
+interner_save_cstring(String_Interner* interner, cstring s) {
+    string_id id = string_map_get(interner->str_to_id, s);
     if (!id) {
-        id = global_interner.id_counter++;
-        string_map_put(global_interner.str_to_id, s, id);
-        array_push(global_interner.id_to_str, string_lit(s));
+        id = interner->id_counter++;
+        string_map_put(interner->str_to_id, s, id);
+        array_push(interner->id_to_str, string_lit(s));
     }
     return id;
 }
 
+string_id
+interner_save_string(String_Interner* interner, string s) {
+    cstring cs = string_to_cstring(s);
+    string_id id = string_map_get(interner->str_to_id, cs);
+    if (id) {
+        cstring_free(cs);
+        return id;
+    }
+    return interner_save_cstring(interner, cs);
+}
+
+// NOTE(Alexander): returns 0 if the string hasn't been interned
+string_id
+interner_find_cstring(String_Interner* interner, cstring s) {
+    return string_map_get(interner->str_to_id, s);
+}
+
+// NOTE(Alexander): only for interners that own their strings i.e. created by interner_save_string
+void
+interner_free(String_Interner* interner) {
+    for (int i = 0; i < string_map_count(interner->str_to_id); i++) {
+        cstring_free(interner->str_to_id[i].key);
+    }
+    string_map_free(interner->str_to_id);
+    array_free(interner->id_to_str);
+    *interner = {};
+}
+
+string_id
+vars_save_cstring(cstring s) {
+    return interner_save_cstring(&global_interner, s);
+}
+
 string_id vars_save_string(string s) {
     cstring cs = string_to_cstring(s);
     return vars_save_cstring(cs);
@@ -120,6 +174,7 @@ struct Ast {
         } Binary;
         struct {
             array(Ast*)* exprs;
+            array(u32)* lines; // source line where each expression starts
         } Block;
     };
 };
@@ -133,7 +188,7 @@ parse_identifier(Parser* parser, Token token) {
     
     if (token.kind == Token_Ident) {
         result->kind = Ast_Ident;
-        result->Ident = vars_save_string(token.source);
+        result->Ident = interner_save_string(parser->interner, token.source);
     } else {
         printf("error: parser expected identifier");
     }
@@ -244,8 +299,10 @@ parse_block(Parser* parser) {
             break;
         }
         
+        u32 line = parser_line_at(parser, peek.source.data);
         Ast* expr = parse_expression(parser);
         array_push(result->Block.exprs, expr);
+        array_push(result->Block.lines, line);
         
         Token token = next_token(parser);
         if (token.kind != Token_Semi) {
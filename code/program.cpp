@@ -0,0 +1,1268 @@
+
+// Embedding API, compile a program once and run it many times with different
+// values bound to its variables.
+//
+// Usage:
+//     Program_Options options = {};
+//     options.backend = ProgramBackend_Vm;
+//     Program* program = program_compile(string_lit("y = x * x; y;"), &options);
+//     s32 x = program_find_variable(program, "x");
+//     for (int i = 0; i < 1000; i++) {
+//         program_bind_index(program, x, i);
+//         s32 y = program_run(program);
+//     }
+//     program_destroy(program);
+//
+// Every run starts with the variables set to their bound value (or zero),
+// nothing is allocated by program_bind or program_run.
+//
+// The JIT backend compiles the free variables (read before they are assigned)
+// into the arguments of a native function, so it can also be called directly:
+//     typedef s32 Square_Func(s32 x);
+//     Square_Func* square = program_function(program, Square_Func);
+//     s32 y = square(i);
+// The arguments are ordered by where the variables first appear in the source,
+// see program_find_parameter. When a run traps (division by zero or S32_MIN / -1)
+// program_run returns 0 and sets program->runtime_error, this is the same for
+// every backend. Calling the native function directly doesn't catch the trap.
+// program_run passes at most JIT_CALL_MAX_ARGUMENTS arguments, so the JIT backend
+// rejects programs with more free variables and the tiered backend keeps them in the VM.
+//
+// The tiered backend starts out in the VM and compiles the program with the JIT
+// once it has been run jit_threshold times, the compile latency is only paid
+// for hot programs. See program_print_stats for when the switch happened.
+// When a Jit_Queue is given in the options the JIT compilation runs on the
+// queue's background thread and the program keeps running in the VM until
+// the native code is published.
+
+#if defined(BUILD_WINDOWS)
+#include <windows.h>
+#elif defined(BUILD_POSIX)
+#include <sys/mman.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <sys/syscall.h>
+#endif
+
+// NOTE(Alexander): threading primitives, used by the code arena and the background JIT
+#if defined(BUILD_WINDOWS)
+typedef CRITICAL_SECTION Jit_Mutex;
+typedef CONDITION_VARIABLE Jit_Condition;
+typedef HANDLE Jit_Thread;
+#define jit_mutex_initialize(m) InitializeCriticalSection(m)
+#define jit_mutex_free(m) DeleteCriticalSection(m)
+#define jit_mutex_lock(m) EnterCriticalSection(m)
+#define jit_mutex_unlock(m) LeaveCriticalSection(m)
+#define jit_condition_initialize(c) InitializeConditionVariable(c)
+#define jit_condition_free(c)
+#define jit_condition_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define jit_condition_broadcast(c) WakeAllConditionVariable(c)
+// NOTE(Alexander): volatile reads have acquire semantics on MSVC x64
+#define atomic_load_pointer(p) (*(void* volatile*) (p))
+#define atomic_store_pointer(p, value) InterlockedExchangePointer((void* volatile*) (p), (value))
+#else
+typedef pthread_mutex_t Jit_Mutex;
+typedef pthread_cond_t Jit_Condition;
+typedef pthread_t Jit_Thread;
+#define jit_mutex_initialize(m) pthread_mutex_init(m, 0)
+#define jit_mutex_free(m) pthread_mutex_destroy(m)
+#define jit_mutex_lock(m) pthread_mutex_lock(m)
+#define jit_mutex_unlock(m) pthread_mutex_unlock(m)
+#define jit_condition_initialize(c) pthread_cond_init(c, 0)
+#define jit_condition_free(c) pthread_cond_destroy(c)
+#define jit_condition_wait(c, m) pthread_cond_wait(c, m)
+#define jit_condition_broadcast(c) pthread_cond_broadcast(c)
+#define atomic_load_pointer(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_store_pointer(p, value) __atomic_store_n((p), (value), __ATOMIC_RELEASE)
+#endif
+
+typedef int asm_main(void);
+
+// NOTE(Alexander): unused arguments are ignored by the callee, so any JIT'd function
+// with up to JIT_CALL_MAX_ARGUMENTS parameters can be called through asm_main_args.
+#define JIT_CALL_MAX_ARGUMENTS 8
+typedef int asm_main_args(s32, s32, s32, s32, s32, s32, s32, s32);
+
+inline int
+jit_call(asm_main* func, s32* args) {
+    return ((asm_main_args*) (void*) func)(args[0], args[1], args[2], args[3],
+                                           args[4], args[5], args[6], args[7]);
+}
+
+// NOTE(Alexander): idiv traps on division by zero and on S32_MIN / -1, jit_call_checked
+// catches the trap and returns an error message instead of taking down the process.
+// Traps outside of a checked call are forwarded to the previous handler.
+#if defined(BUILD_POSIX)
+global thread_local sigjmp_buf* jit_trap_target;
+global struct sigaction jit_previous_sigfpe;
+
+internal void
+jit_sigfpe_handler(int signal_number, siginfo_t* info, void* context) {
+    if (jit_trap_target) {
+        siglongjmp(*jit_trap_target, 1);
+    }
+    
+    if (jit_previous_sigfpe.sa_flags & SA_SIGINFO) {
+        jit_previous_sigfpe.sa_sigaction(signal_number, info, context);
+    } else if (jit_previous_sigfpe.sa_handler != SIG_DFL && jit_previous_sigfpe.sa_handler != SIG_IGN) {
+        jit_previous_sigfpe.sa_handler(signal_number);
+    } else {
+        // NOTE(Alexander): the default action terminates the process, returning would execute
+        // the faulting instruction again, so it's taken here. A SIGFPE from a trap can't be
+        // ignored either, it would loop forever.
+        signal(SIGFPE, SIG_DFL);
+        raise(SIGFPE);
+    }
+}
+
+internal void
+jit_install_sigfpe_handler() {
+    struct sigaction action = {};
+    action.sa_sigaction = jit_sigfpe_handler;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGFPE, &action, &jit_previous_sigfpe);
+}
+#endif
+
+cstring
+jit_call_checked(asm_main* func, s32* args, s32* result) {
+#if defined(BUILD_WINDOWS)
+    __try {
+        *result = jit_call(func, args);
+    } __except (GetExceptionCode() == EXCEPTION_INT_DIVIDE_BY_ZERO ||
+                GetExceptionCode() == EXCEPTION_INT_OVERFLOW ?
+                EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+        *result = 0;
+        return RUNTIME_ERROR_DIVISION;
+    }
+    return 0;
+#elif defined(BUILD_POSIX)
+    local_persist pthread_once_t install_once = PTHREAD_ONCE_INIT;
+    pthread_once(&install_once, jit_install_sigfpe_handler);
+    
+    // NOTE(Alexander): the signal mask isn't saved, SA_NODEFER keeps SIGFPE unblocked
+    sigjmp_buf target;
+    if (sigsetjmp(target, 0)) {
+        jit_trap_target = 0;
+        *result = 0;
+        return RUNTIME_ERROR_DIVISION;
+    }
+    jit_trap_target = &target;
+    *result = jit_call(func, args);
+    jit_trap_target = 0;
+    return 0;
+#else
+    *result = jit_call(func, args);
+    return 0;
+#endif
+}
+
+// Linux perf integration
+//
+// perf only sees anonymous executable memory for JIT'd code. Once jit_perf_open
+// is called every function pushed to the code arena is described in
+//     /tmp/perf-<pid>.map   address, size and name of each function, perf report
+//                           reads it by itself
+//     /tmp/jit-<pid>.dump   the jitdump format, the code bytes and the source line
+//                           of each statement for perf annotate, it has to be
+//                           merged into the recording:
+//                               perf record -k mono <command>
+//                               perf inject --jit -i perf.data -o perf.jit.data
+//                               perf report -i perf.jit.data
+// The functions are named jit_function_<n> in the order they were compiled.
+
+#define JIT_DUMP_MAGIC 0x4A695444
+#define JIT_DUMP_VERSION 1
+#define JIT_DUMP_CODE_LOAD 0
+#define JIT_DUMP_DEBUG_INFO 2
+#define JIT_DUMP_CODE_CLOSE 3
+
+enum Jit_Perf_Flags {
+    JitPerf_Map = bit(0),
+    JitPerf_Dump = bit(1),
+};
+
+struct Jit_Dump_Header {
+    u32 magic;
+    u32 version;
+    u32 total_size; // of this header
+    u32 elf_machine;
+    u32 pad;
+    u32 pid;
+    u64 timestamp;
+    u64 flags;
+};
+
+struct Jit_Dump_Record_Header {
+    u32 id;
+    u32 total_size; // including the header and whatever follows the record
+    u64 timestamp;
+};
+
+// NOTE(Alexander): followed by the zero terminated name and the code bytes
+struct Jit_Dump_Code_Load {
+    Jit_Dump_Record_Header header;
+    u32 pid;
+    u32 tid;
+    u64 virtual_address;
+    u64 code_address;
+    u64 code_size;
+    u64 code_index;
+};
+
+// NOTE(Alexander): followed by entry_count entries, each one followed by the zero terminated file name
+struct Jit_Dump_Debug_Info {
+    Jit_Dump_Record_Header header;
+    u64 code_address;
+    u64 entry_count;
+};
+
+struct Jit_Dump_Debug_Entry {
+    u64 code_address;
+    u32 line;
+    u32 discriminator;
+};
+
+struct Jit_Perf {
+    u32 flags; // Jit_Perf_Flags, 0 when it's disabled
+    Jit_Mutex mutex;
+    FILE* map_file;
+    FILE* dump_file;
+    void* dump_marker; // perf record finds the dump file through this executable mapping
+    umm dump_marker_size;
+    cstring source_name;
+    u64 code_index;
+};
+
+global Jit_Perf jit_perf;
+
+#if defined(BUILD_POSIX)
+// NOTE(Alexander): perf record -k mono timestamps samples with the monotonic clock
+internal u64
+jit_perf_timestamp() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (u64) time.tv_sec*1000000000ull + (u64) time.tv_nsec;
+}
+
+internal void
+jit_perf_write_record_header(u32 id, u32 total_size) {
+    Jit_Dump_Record_Header header = { id, total_size, jit_perf_timestamp() };
+    fwrite(&header, sizeof(header), 1, jit_perf.dump_file);
+}
+#endif
+
+// NOTE(Alexander): source_name is the file the statements come from, the line numbers
+// are left out of the jitdump if it's 0. Returns false if no file could be opened.
+bool
+jit_perf_open(u32 flags, cstring source_name) {
+#if defined(BUILD_POSIX)
+    if (jit_perf.flags) {
+        return true;
+    }
+    
+    char filepath[64];
+    if (flags & JitPerf_Map) {
+        snprintf(filepath, sizeof(filepath), "/tmp/perf-%d.map", (int) getpid());
+        jit_perf.map_file = fopen(filepath, "w");
+        if (!jit_perf.map_file) {
+            pln("error: could not write `%`", f_cstring(filepath));
+            flags &= ~JitPerf_Map;
+        }
+    }
+    
+    if (flags & JitPerf_Dump) {
+        snprintf(filepath, sizeof(filepath), "/tmp/jit-%d.dump", (int) getpid());
+        jit_perf.dump_file = fopen(filepath, "w+");
+        if (jit_perf.dump_file) {
+            Jit_Dump_Header header = {};
+            header.magic = JIT_DUMP_MAGIC;
+            header.version = JIT_DUMP_VERSION;
+            header.total_size = sizeof(header);
+            header.elf_machine = 62; // x86-64
+            header.pid = (u32) getpid();
+            header.timestamp = jit_perf_timestamp();
+            fwrite(&header, sizeof(header), 1, jit_perf.dump_file);
+            fflush(jit_perf.dump_file);
+            
+            jit_perf.dump_marker_size = (umm) sysconf(_SC_PAGESIZE);
+            jit_perf.dump_marker = mmap(0, jit_perf.dump_marker_size, PROT_READ | PROT_EXEC, MAP_PRIVATE,
+                                        fileno(jit_perf.dump_file), 0);
+            if (jit_perf.dump_marker == MAP_FAILED) {
+                jit_perf.dump_marker = 0;
+            }
+        }
+        if (!jit_perf.dump_marker) {
+            pln("error: could not write `%`", f_cstring(filepath));
+            if (jit_perf.dump_file) fclose(jit_perf.dump_file);
+            jit_perf.dump_file = 0;
+            flags &= ~JitPerf_Dump;
+        }
+    }
+    
+    if (flags) {
+        jit_mutex_initialize(&jit_perf.mutex);
+        jit_perf.source_name = source_name;
+        jit_perf.flags = flags;
+    }
+    return flags != 0;
+#else
+    return false;
+#endif
+}
+
+// NOTE(Alexander): called by jit_arena_push for every function, does nothing unless jit_perf_open was called
+void
+jit_perf_record(asm_main* func, Machine_Code code) {
+#if defined(BUILD_POSIX)
+    if (!jit_perf.flags || !func) {
+        return;
+    }
+    
+    jit_mutex_lock(&jit_perf.mutex);
+    u64 code_index = jit_perf.code_index++;
+    char name[32];
+    snprintf(name, sizeof(name), "jit_function_%llu", (unsigned long long) code_index);
+    u64 address = (u64) func;
+    
+    if (jit_perf.map_file) {
+        fprintf(jit_perf.map_file, "%llx %llx %s\n", (unsigned long long) address,
+                (unsigned long long) code.size, name);
+        fflush(jit_perf.map_file);
+    }
+    
+    if (jit_perf.dump_file) {
+        // NOTE(Alexander): the debug info has to come before the code it describes,
+        // the prologue and the argument copies don't have a line
+        FILE* file = jit_perf.dump_file;
+        umm source_name_size = jit_perf.source_name ? strlen(jit_perf.source_name) + 1 : 0;
+        u64 entry_count = 0;
+        for_array(code.lines, line, _) {
+            if (line->line && source_name_size) entry_count++;
+        }
+        
+        if (entry_count > 0) {
+            Jit_Dump_Debug_Info info = {};
+            info.code_address = address;
+            info.entry_count = entry_count;
+            jit_perf_write_record_header(JIT_DUMP_DEBUG_INFO, (u32) (sizeof(info) + entry_count*
+                                                                     (sizeof(Jit_Dump_Debug_Entry) + source_name_size)));
+            fwrite((u8*) &info + sizeof(info.header), sizeof(info) - sizeof(info.header), 1, file);
+            for_array(code.lines, line, _) {
+                if (!line->line) continue;
+                Jit_Dump_Debug_Entry entry = { address + line->offset, line->line, 0 };
+                fwrite(&entry, sizeof(entry), 1, file);
+                fwrite(jit_perf.source_name, source_name_size, 1, file);
+            }
+        }
+        
+        Jit_Dump_Code_Load load = {};
+        load.pid = (u32) getpid();
+#if defined(SYS_gettid)
+        load.tid = (u32) syscall(SYS_gettid);
+#else
+        load.tid = load.pid;
+#endif
+        load.virtual_address = address;
+        load.code_address = address;
+        load.code_size = code.size;
+        load.code_index = code_index;
+        umm name_size = strlen(name) + 1;
+        jit_perf_write_record_header(JIT_DUMP_CODE_LOAD, (u32) (sizeof(load) + name_size + code.size));
+        fwrite((u8*) &load + sizeof(load.header), sizeof(load) - sizeof(load.header), 1, file);
+        fwrite(name, name_size, 1, file);
+        fwrite(code.bytes, code.size, 1, file);
+        fflush(file);
+    }
+    jit_mutex_unlock(&jit_perf.mutex);
+#endif
+}
+
+void
+jit_perf_close() {
+#if defined(BUILD_POSIX)
+    if (!jit_perf.flags) {
+        return;
+    }
+    
+    if (jit_perf.map_file) {
+        fclose(jit_perf.map_file);
+    }
+    if (jit_perf.dump_file) {
+        jit_perf_write_record_header(JIT_DUMP_CODE_CLOSE, sizeof(Jit_Dump_Record_Header));
+        munmap(jit_perf.dump_marker, jit_perf.dump_marker_size);
+        fclose(jit_perf.dump_file);
+    }
+    jit_mutex_free(&jit_perf.mutex);
+    jit_perf = {};
+#endif
+}
+
+// Executable code arena
+//
+// JIT'd functions are bump allocated from one large range of reserved virtual
+// memory, so compiling a program doesn't map any memory. The range is split in
+// chunks that are committed the first time they are used. Code is copied into
+// writable pages and only becomes executable when the arena is sealed, which
+// flips the pages written since the last seal to read+exec with one protect
+// call per chunk. No page is ever writable and executable at the same time
+// (W^X), so the next function starts on a fresh page after a seal. Compiling
+// a batch of functions before sealing pays for the protect call only once.
+//
+// Functions are recycled a chunk at a time, once every function in a chunk
+// has been freed the chunk goes on a free list and is made writable again
+// when it's reused.
+
+#define JIT_ARENA_RESERVE_SIZE gigabytes(1)
+#define JIT_ARENA_CHUNK_SIZE kilobytes(64)
+#define JIT_FUNCTION_ALIGNMENT 16
+
+struct Jit_Chunk {
+    u32 live_count; // functions in the chunk that haven't been freed
+    u32 span; // consecutive chunks, only functions larger than a chunk span more than one
+    umm sealed; // bytes from the start of the chunk that are read+exec
+    umm used; // bytes from the start of the chunk that have been written
+    b32 is_pending; // written since the last seal
+    s32 next_free;
+};
+
+struct Jit_Arena_Stats {
+    u64 function_count;
+    u64 seal_count;
+    u64 protect_count; // calls to mprotect/VirtualProtect, including commits
+    u64 recycled_count; // chunks that were reused after all their functions were freed
+};
+
+struct Jit_Code_Arena {
+    Jit_Mutex mutex;
+    u8* base;
+    umm page_size;
+    s32 chunk_count; // chunks in the reserved range
+    s32 committed_count; // chunks [0, committed_count) have been taken into use
+    s32 current; // chunk new functions are pushed to, -1 if there is none
+    s32 first_free; // -1 if there are no free chunks
+    Jit_Chunk* chunks;
+    array(s32)* pending; // chunks that have to be sealed
+    Jit_Arena_Stats stats;
+};
+
+internal bool
+jit_arena_protect(Jit_Code_Arena* arena, u8* memory, umm size, bool is_executable) {
+    arena->stats.protect_count++;
+#if defined(BUILD_WINDOWS)
+    DWORD prev_protect = 0;
+    return VirtualProtect(memory, size, is_executable ? PAGE_EXECUTE_READ : PAGE_READWRITE, &prev_protect);
+#elif defined(BUILD_POSIX)
+    return mprotect(memory, size, is_executable ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE) == 0;
+#else
+    return false;
+#endif
+}
+
+// NOTE(Alexander): returns false if the JIT isn't supported on this platform or the range can't be reserved
+bool
+jit_arena_initialize(Jit_Code_Arena* arena, umm reserve_size) {
+    *arena = {};
+    arena->current = -1;
+    arena->first_free = -1;
+    
+#if defined(BUILD_WINDOWS)
+    SYSTEM_INFO system_info;
+    GetSystemInfo(&system_info);
+    arena->page_size = system_info.dwPageSize;
+    arena->base = (u8*) VirtualAlloc(0, reserve_size, MEM_RESERVE, PAGE_NOACCESS);
+#elif defined(BUILD_POSIX)
+    arena->page_size = (umm) sysconf(_SC_PAGESIZE);
+    void* base = mmap(0, reserve_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    arena->base = base == MAP_FAILED ? 0 : (u8*) base;
+#endif
+    if (!arena->base) {
+        return false;
+    }
+    
+    arena->chunk_count = (s32) (reserve_size / JIT_ARENA_CHUNK_SIZE);
+    arena->chunks = (Jit_Chunk*) calloc(arena->chunk_count, sizeof(Jit_Chunk));
+    jit_mutex_initialize(&arena->mutex);
+    return true;
+}
+
+// NOTE(Alexander): the whole range is released, every function in it becomes invalid
+void
+jit_arena_free(Jit_Code_Arena* arena) {
+    if (!arena->base) return;
+    
+#if defined(BUILD_WINDOWS)
+    VirtualFree(arena->base, 0, MEM_RELEASE);
+#elif defined(BUILD_POSIX)
+    munmap(arena->base, (umm) arena->chunk_count*JIT_ARENA_CHUNK_SIZE);
+#endif
+    jit_mutex_free(&arena->mutex);
+    free(arena->chunks);
+    array_free(arena->pending);
+    *arena = {};
+}
+
+// NOTE(Alexander): takes span writable chunks, a free chunk if there is one that is large enough,
+// returns -1 when the reserved range is used up
+internal s32
+jit_arena_take_chunks(Jit_Code_Arena* arena, s32 span) {
+    s32 index = arena->first_free;
+    if (index >= 0 && (s32) arena->chunks[index].span >= span) {
+        arena->first_free = arena->chunks[index].next_free;
+        arena->stats.recycled_count++;
+        span = arena->chunks[index].span;
+        jit_arena_protect(arena, arena->base + (umm) index*JIT_ARENA_CHUNK_SIZE,
+                          (umm) span*JIT_ARENA_CHUNK_SIZE, false);
+    } else {
+        if (arena->committed_count + span > arena->chunk_count) {
+            return -1;
+        }
+        
+        index = arena->committed_count;
+        arena->committed_count += span;
+        u8* memory = arena->base + (umm) index*JIT_ARENA_CHUNK_SIZE;
+        umm size = (umm) span*JIT_ARENA_CHUNK_SIZE;
+#if defined(BUILD_WINDOWS)
+        arena->stats.protect_count++;
+        if (!VirtualAlloc(memory, size, MEM_COMMIT, PAGE_READWRITE)) {
+            return -1;
+        }
+#else
+        if (!jit_arena_protect(arena, memory, size, false)) {
+            return -1;
+        }
+#endif
+    }
+    
+    Jit_Chunk* chunk = arena->chunks + index;
+    *chunk = {};
+    chunk->span = span;
+    chunk->next_free = -1;
+    return index;
+}
+
+internal void
+jit_arena_release_chunk(Jit_Code_Arena* arena, s32 index) {
+    arena->chunks[index].next_free = arena->first_free;
+    arena->first_free = index;
+}
+
+// NOTE(Alexander): copies the machine code into the arena, the function can't be
+// called until the arena is sealed. Returns 0 if the arena is full.
+asm_main*
+jit_arena_push(Jit_Code_Arena* arena, Machine_Code code) {
+    jit_mutex_lock(&arena->mutex);
+    umm size = max(code.size, 1);
+    umm offset = 0;
+    
+    Jit_Chunk* chunk = 0;
+    if (arena->current >= 0) {
+        chunk = arena->chunks + arena->current;
+        offset = align_forward(chunk->used, JIT_FUNCTION_ALIGNMENT);
+        if (offset + size > (umm) chunk->span*JIT_ARENA_CHUNK_SIZE) {
+            if (chunk->live_count == 0 && !chunk->is_pending) {
+                jit_arena_release_chunk(arena, arena->current);
+            }
+            arena->current = -1;
+            chunk = 0;
+        }
+    }
+    
+    if (!chunk) {
+        s32 span = (s32) ((size + JIT_ARENA_CHUNK_SIZE - 1) / JIT_ARENA_CHUNK_SIZE);
+        s32 index = jit_arena_take_chunks(arena, span);
+        if (index < 0) {
+            jit_mutex_unlock(&arena->mutex);
+            return 0;
+        }
+        
+        // NOTE(Alexander): functions are freed by their first chunk, so nothing else
+        // is placed in a chunk that a large function spills into
+        arena->current = span == 1 ? index : -1;
+        chunk = arena->chunks + index;
+        offset = 0;
+    }
+    
+    u8* result = arena->base + (umm) (chunk - arena->chunks)*JIT_ARENA_CHUNK_SIZE + offset;
+    memcpy(result, code.bytes, code.size);
+    chunk->used = offset + size;
+    chunk->live_count++;
+    if (!chunk->is_pending) {
+        chunk->is_pending = true;
+        array_push(arena->pending, (s32) (chunk - arena->chunks));
+    }
+    arena->stats.function_count++;
+    
+    jit_mutex_unlock(&arena->mutex);
+    jit_perf_record((asm_main*) result, code);
+    return (asm_main*) result;
+}
+
+// NOTE(Alexander): makes every function pushed since the last seal executable
+void
+jit_arena_seal(Jit_Code_Arena* arena) {
+    jit_mutex_lock(&arena->mutex);
+    for_array_v(arena->pending, index, _) {
+        Jit_Chunk* chunk = arena->chunks + index;
+        u8* memory = arena->base + (umm) index*JIT_ARENA_CHUNK_SIZE;
+        umm end = align_forward(chunk->used, arena->page_size);
+        jit_arena_protect(arena, memory + chunk->sealed, end - chunk->sealed, true);
+        chunk->sealed = end;
+        chunk->used = end;
+        chunk->is_pending = false;
+        if (chunk->live_count == 0 && index != arena->current) {
+            jit_arena_release_chunk(arena, index);
+        }
+    }
+    
+    if (array_count(arena->pending) > 0) {
+        arena->stats.seal_count++;
+#if defined(BUILD_WINDOWS)
+        FlushInstructionCache(GetCurrentProcess(), 0, 0);
+#endif
+    }
+    array_set_count(arena->pending, 0);
+    jit_mutex_unlock(&arena->mutex);
+}
+
+void
+jit_arena_free_function(Jit_Code_Arena* arena, asm_main* func) {
+    jit_mutex_lock(&arena->mutex);
+    s32 index = (s32) (((u8*) func - arena->base) / JIT_ARENA_CHUNK_SIZE);
+    assert(index >= 0 && index < arena->committed_count && "function is not in the code arena");
+    Jit_Chunk* chunk = arena->chunks + index;
+    assert(chunk->live_count > 0 && "function was already freed");
+    chunk->live_count--;
+    if (chunk->live_count == 0 && index != arena->current && !chunk->is_pending) {
+        jit_arena_release_chunk(arena, index);
+    }
+    jit_mutex_unlock(&arena->mutex);
+}
+
+void
+jit_arena_print_stats(Jit_Code_Arena* arena) {
+    pln("JIT code arena: % functions, % chunks committed (% KB), % seals, % protect calls, % chunks recycled",
+        f_u64(arena->stats.function_count), f_int(arena->committed_count),
+        f_smm(arena->committed_count*JIT_ARENA_CHUNK_SIZE/1024), f_u64(arena->stats.seal_count),
+        f_u64(arena->stats.protect_count), f_u64(arena->stats.recycled_count));
+}
+
+// NOTE(Alexander): the arena shared by every JIT'd function, reserved on first use
+Jit_Code_Arena*
+jit_get_code_arena() {
+    local_persist Jit_Code_Arena arena;
+    local_persist b32 is_initialized = jit_arena_initialize(&arena, JIT_ARENA_RESERVE_SIZE);
+    return is_initialized ? &arena : 0;
+}
+
+// NOTE(Alexander): copies the machine code into memory that can be executed
+asm_main*
+jit_allocate_executable(Machine_Code code) {
+    Jit_Code_Arena* arena = jit_get_code_arena();
+    if (!arena) {
+        return 0;
+    }
+    
+    asm_main* result = jit_arena_push(arena, code);
+    jit_arena_seal(arena);
+    return result;
+}
+
+// NOTE(Alexander): runs the whole x64 pipeline, the function is in the code arena and can't be called
+// before it's sealed. Returns 0 if the JIT isn't supported on this platform.
+asm_main*
+jit_compile_unsealed(array(Bc_Instruction)* instructions) {
+    asm_main* result = 0;
+    
+#if defined(BUILD_X64)
+    Jit_Code_Arena* arena = jit_get_code_arena();
+    if (!arena) {
+        return 0;
+    }
+    
+    X64_Builder x64_builder = {};
+    convert_to_x64(&x64_builder, instructions);
+    X64_Allocation_Stats allocation_stats = {};
+    allocate_x64_registers(&x64_builder, &allocation_stats);
+    Machine_Code code = assemble_to_x64_machine_code(x64_builder.instructions);
+    result = jit_arena_push(arena, code);
+    free(code.bytes);
+    array_free(code.lines);
+    
+    array_free(x64_builder.instructions);
+    array_free(x64_builder.parameters);
+    map_free(x64_builder.stack_offsets);
+#endif
+    
+    return result;
+}
+
+asm_main*
+jit_compile(array(Bc_Instruction)* instructions) {
+    asm_main* result = jit_compile_unsealed(instructions);
+    if (result) {
+        jit_arena_seal(jit_get_code_arena());
+    }
+    return result;
+}
+
+void
+jit_free_executable(asm_main* func) {
+    if (!func) return;
+    jit_arena_free_function(jit_get_code_arena(), func);
+}
+
+// Background JIT compilation
+
+enum Jit_Job_State {
+    JitJob_None,
+    JitJob_Queued,
+    JitJob_Done,
+};
+
+struct Jit_Job {
+    array(Bc_Instruction)* instructions; // has to stay alive until the job is done
+    asm_main** target; // the compiled function is published here with an atomic store
+    f64 compile_seconds;
+    Jit_Job_State state; // guarded by the queue mutex
+    Jit_Job* next;
+};
+
+struct Jit_Queue {
+    Jit_Mutex mutex;
+    Jit_Condition condition; // signaled when jobs are submitted or done and when stopping
+    Jit_Thread thread;
+    Jit_Job* first;
+    Jit_Job* last;
+    b32 is_running;
+};
+
+// NOTE(Alexander): every job that is queued is taken at once, the batch is compiled
+// and the code arena is sealed once before the functions are published
+void
+jit_queue_work(Jit_Queue* queue) {
+    jit_mutex_lock(&queue->mutex);
+    for (;;) {
+        while (!queue->first && queue->is_running) {
+            jit_condition_wait(&queue->condition, &queue->mutex);
+        }
+        
+        Jit_Job* first = queue->first;
+        if (!first) {
+            break;
+        }
+        queue->first = 0;
+        queue->last = 0;
+        jit_mutex_unlock(&queue->mutex);
+        
+        array(asm_main*)* funcs = 0;
+        for (Jit_Job* job = first; job; job = job->next) {
+            f64 begin = get_wall_clock_seconds();
+            array_push(funcs, jit_compile_unsealed(job->instructions));
+            job->compile_seconds = get_wall_clock_seconds() - begin;
+        }
+        
+        Jit_Code_Arena* arena = jit_get_code_arena();
+        if (arena) {
+            jit_arena_seal(arena);
+        }
+        
+        smm job_index = 0;
+        for (Jit_Job* job = first; job; job = job->next) {
+            atomic_store_pointer(job->target, funcs[job_index++]);
+        }
+        array_free(funcs);
+        
+        jit_mutex_lock(&queue->mutex);
+        for (Jit_Job* job = first; job;) {
+            // NOTE(Alexander): the job may be reused as soon as it's done
+            Jit_Job* next = job->next;
+            job->state = JitJob_Done;
+            job = next;
+        }
+        jit_condition_broadcast(&queue->condition);
+    }
+    jit_mutex_unlock(&queue->mutex);
+}
+
+#if defined(BUILD_WINDOWS)
+DWORD WINAPI
+jit_queue_thread_proc(LPVOID data) {
+    jit_queue_work((Jit_Queue*) data);
+    return 0;
+}
+#else
+void*
+jit_queue_thread_proc(void* data) {
+    jit_queue_work((Jit_Queue*) data);
+    return 0;
+}
+#endif
+
+void
+jit_queue_start(Jit_Queue* queue) {
+    *queue = {};
+    jit_mutex_initialize(&queue->mutex);
+    jit_condition_initialize(&queue->condition);
+    queue->is_running = true;
+#if defined(BUILD_WINDOWS)
+    queue->thread = CreateThread(0, 0, jit_queue_thread_proc, queue, 0, 0);
+#else
+    pthread_create(&queue->thread, 0, jit_queue_thread_proc, queue);
+#endif
+}
+
+// NOTE(Alexander): jobs that are already queued are compiled before the thread exits
+void
+jit_queue_stop(Jit_Queue* queue) {
+    jit_mutex_lock(&queue->mutex);
+    queue->is_running = false;
+    jit_condition_broadcast(&queue->condition);
+    jit_mutex_unlock(&queue->mutex);
+    
+#if defined(BUILD_WINDOWS)
+    WaitForSingleObject(queue->thread, INFINITE);
+    CloseHandle(queue->thread);
+#else
+    pthread_join(queue->thread, 0);
+#endif
+    jit_condition_free(&queue->condition);
+    jit_mutex_free(&queue->mutex);
+}
+
+void
+jit_queue_submit(Jit_Queue* queue, Jit_Job* job) {
+    jit_mutex_lock(&queue->mutex);
+    assert(queue->is_running && "submitting to a stopped JIT queue");
+    job->state = JitJob_Queued;
+    job->next = 0;
+    if (queue->last) {
+        queue->last->next = job;
+    } else {
+        queue->first = job;
+    }
+    queue->last = job;
+    jit_condition_broadcast(&queue->condition);
+    jit_mutex_unlock(&queue->mutex);
+}
+
+void
+jit_queue_wait(Jit_Queue* queue, Jit_Job* job) {
+    jit_mutex_lock(&queue->mutex);
+    while (job->state == JitJob_Queued) {
+        jit_condition_wait(&queue->condition, &queue->mutex);
+    }
+    jit_mutex_unlock(&queue->mutex);
+}
+
+enum Program_Backend {
+    ProgramBackend_Interp,
+    ProgramBackend_Closure,
+    ProgramBackend_Vm,
+    ProgramBackend_Jit,
+    ProgramBackend_Tiered, // starts in the VM, promoted to the JIT once it's hot
+};
+
+const cstring program_backend_names[] = {
+    "interp", "closure", "vm", "jit", "tiered"
+};
+
+#define PROGRAM_DEFAULT_JIT_THRESHOLD 1000
+
+struct Program_Options {
+    Program_Backend backend;
+    s32 jit_threshold; // tiered backend: runs in the VM before compiling with the JIT, 0 for default
+    Jit_Queue* jit_queue; // tiered backend: compiles on this queue's thread instead of in program_run
+    
+    // NOTE(Alexander): bytecode optimizations for the VM and JIT, passes overrides the level
+    int optimization_level;
+    cstring passes; // comma separated pass names, see DEF_BC_PASSES
+};
+
+enum Program_Tier {
+    ProgramTier_Vm,
+    ProgramTier_Jit,
+    ProgramTier_Count,
+};
+
+const cstring program_tier_names[] = {
+    "vm", "jit"
+};
+
+struct Program_Stats {
+    u64 run_counts[ProgramTier_Count];
+    u64 queued_at_run; // background compilation only, the run that submitted the JIT job
+    u64 promoted_at_run; // number of runs before switching to the JIT, 0 if it wasn't promoted
+    f64 jit_compile_seconds;
+};
+
+struct Program_Variable {
+    string_id ident;
+    s32 value;
+    s32 closure_slot;
+    s32 vm_slot;
+    s32 parameter_index; // argument of the JIT'd function, -1 if it's not a free variable
+};
+
+struct Program {
+    Program_Backend backend;
+    
+    String_Interner interner;
+    Memory_Arena ast_arena;
+    Ast* ast;
+    Bc_Builder bc;
+    
+    array(Program_Variable)* variables;
+    
+    Interp interp;
+    
+    Closure_Program closure;
+    s32* closure_slots;
+    s32* closure_bindings;
+    
+    Vm vm;
+    
+    asm_main* jit_func;
+    s32 parameter_count;
+    s32 jit_arguments[JIT_CALL_MAX_ARGUMENTS];
+    cstring runtime_error; // set by program_run when the last run trapped, 0 otherwise
+    
+    s32 jit_threshold;
+    Jit_Queue* jit_queue;
+    Jit_Job jit_job;
+    Program_Stats stats;
+};
+
+// NOTE(Alexander): cast through void* since the real signature isn't asm_main
+#define program_function(program, type) ((type*) (void*) (program)->jit_func)
+
+void program_destroy(Program* program);
+
+void
+program_initialize_vm(Program* program) {
+    vm_initialize(&program->vm, program->bc.instructions, program->bc.next_free_register);
+    for_array(program->variables, var, _) {
+        Bc_Operand slot = map_get(program->bc.locals, var->ident);
+        var->vm_slot = vm_find_slot(program->bc.instructions, slot.Register);
+    }
+}
+
+// NOTE(Alexander): returns false if the JIT isn't supported on this platform
+bool
+program_compile_jit(Program* program) {
+    f64 begin = get_wall_clock_seconds();
+    program->jit_func = jit_compile(program->bc.instructions);
+    program->stats.jit_compile_seconds = get_wall_clock_seconds() - begin;
+    return program->jit_func != 0;
+}
+
+Program*
+program_compile(string source, Program_Options* options) {
+    Program* program = (Program*) calloc(1, sizeof(Program));
+    program->backend = options->backend;
+    program->jit_threshold = options->jit_threshold > 0 ? options->jit_threshold : PROGRAM_DEFAULT_JIT_THRESHOLD;
+    program->jit_queue = options->jit_queue;
+    program->interner.id_counter = 1;
+    
+    // Parse
+    Tokenizer tokenizer = {};
+    tokenizer.start = source.data;
+    tokenizer.end = tokenizer.start + source.count;
+    tokenizer.curr = tokenizer.start;
+    
+    Parser parser = {};
+    parser.tokenizer = &tokenizer;
+    parser.interner = &program->interner;
+    program->ast = parse_block(&parser);
+    program->ast_arena = parser.ast_arena;
+    
+    // NOTE(Alexander): the bytecode is always built, its locals are the variables of the program
+    bc_build_expression(&program->bc, program->ast);
+    
+    Bc_Pass_Manager pass_manager = {};
+    bool passes_valid = true;
+    if (options->passes) {
+        passes_valid = bc_pass_manager_add_list(&pass_manager, options->passes);
+    } else {
+        bc_pass_manager_add_pipeline(&pass_manager, options->optimization_level);
+    }
+    if (array_count(pass_manager.passes) > 0) {
+        array(Bc_Instruction)* optimized = bc_pass_manager_run(&pass_manager, program->bc.instructions,
+                                                               &program->bc.next_free_register);
+        array_free(program->bc.instructions);
+        program->bc.instructions = optimized;
+    }
+    bc_pass_manager_free(&pass_manager);
+    if (!passes_valid) {
+        program_destroy(program);
+        return 0;
+    }
+    
+    for_map(program->bc.locals, it) {
+        Program_Variable var = {};
+        var.ident = it->key;
+        var.closure_slot = -1;
+        var.vm_slot = -1;
+        var.parameter_index = -1;
+        array_push(program->variables, var);
+    }
+    
+    // NOTE(Alexander): same order as the arguments of the JIT'd function, see convert_to_x64
+    array(u32)* parameters = bc_find_free_variables(program->bc.instructions, program->bc.next_free_register);
+    program->parameter_count = (s32) array_count(parameters);
+    for_array(program->variables, var, _) {
+        Bc_Operand slot = map_get(program->bc.locals, var->ident);
+        for_array(parameters, param, param_index) {
+            if (*param == slot.Register) {
+                var->parameter_index = (s32) param_index;
+            }
+        }
+    }
+    array_free(parameters);
+    
+    switch (program->backend) {
+        case ProgramBackend_Interp: {
+            // NOTE(Alexander): every variable is inserted up front so running never grows the map
+            Interp_Scope scope = {};
+            for_array(program->variables, var, _) {
+                Value value = {};
+                value.type = Value_integer;
+                map_put(scope.locals, var->ident, value);
+            }
+            array_push(program->interp.scopes, scope);
+        } break;
+        
+        case ProgramBackend_Closure: {
+            closure_compile(&program->closure, program->ast);
+            s32 slot_count = max(program->closure.slot_count, 1);
+            program->closure_slots = (s32*) calloc(slot_count, sizeof(s32));
+            program->closure_bindings = (s32*) calloc(slot_count, sizeof(s32));
+            for_array(program->variables, var, _) {
+                var->closure_slot = map_get(program->closure.slot_indices, var->ident);
+            }
+        } break;
+        
+        case ProgramBackend_Vm: {
+            program_initialize_vm(program);
+        } break;
+        
+        case ProgramBackend_Jit: {
+            // NOTE(Alexander): jit_call only passes JIT_CALL_MAX_ARGUMENTS arguments, the code would read
+            // garbage for the rest, the tiered backend keeps these programs in the VM instead
+            if (program->parameter_count > JIT_CALL_MAX_ARGUMENTS) {
+                pln("error: the JIT backend supports up to % free variables, the program has %",
+                    f_int(JIT_CALL_MAX_ARGUMENTS), f_int(program->parameter_count));
+                program_destroy(program);
+                return 0;
+            }
+            if (!program_compile_jit(program)) {
+                pln("error: failed to compile the program with the X64 JIT");
+                program_destroy(program);
+                return 0;
+            }
+        } break;
+        
+        case ProgramBackend_Tiered: {
+            // NOTE(Alexander): the JIT is compiled lazily by program_run
+            program_initialize_vm(program);
+        } break;
+    }
+    
+    return program;
+}
+
+// NOTE(Alexander): returns the variable index used by program_bind_index or -1 if not found
+s32
+program_find_variable(Program* program, cstring name) {
+    string_id ident = interner_find_cstring(&program->interner, name);
+    for_array(program->variables, var, var_index) {
+        if (var->ident == ident) {
+            return var_index;
+        }
+    }
+    return -1;
+}
+
+// NOTE(Alexander): returns the argument index of a free variable in the JIT'd function or -1
+s32
+program_find_parameter(Program* program, cstring name) {
+    s32 var_index = program_find_variable(program, name);
+    return var_index >= 0 ? program->variables[var_index].parameter_index : -1;
+}
+
+// NOTE(Alexander): returns false if the variable doesn't exist
+bool
+program_bind_index(Program* program, s32 var_index, s32 value) {
+    if (var_index < 0 || var_index >= array_count(program->variables)) {
+        return false;
+    }
+    
+    Program_Variable* var = program->variables + var_index;
+    var->value = value;
+    switch (program->backend) {
+        case ProgramBackend_Interp: break; // set at the start of the run
+        
+        case ProgramBackend_Closure: {
+            if (var->closure_slot >= 0) {
+                program->closure_bindings[var->closure_slot] = value;
+            }
+        } break;
+        
+        case ProgramBackend_Vm: {
+            if (var->vm_slot >= 0) {
+                vm_bind(&program->vm, var->vm_slot, value);
+            }
+        } break;
+        
+        case ProgramBackend_Jit: {
+            if (var->parameter_index >= 0 && var->parameter_index < JIT_CALL_MAX_ARGUMENTS) {
+                program->jit_arguments[var->parameter_index] = value;
+            }
+        } break;
+        
+        case ProgramBackend_Tiered: {
+            // NOTE(Alexander): bound in both tiers, so nothing has to be copied on promotion
+            if (var->vm_slot >= 0) {
+                vm_bind(&program->vm, var->vm_slot, value);
+            }
+            if (var->parameter_index >= 0 && var->parameter_index < JIT_CALL_MAX_ARGUMENTS) {
+                program->jit_arguments[var->parameter_index] = value;
+            }
+        } break;
+    }
+    return true;
+}
+
+bool
+program_bind(Program* program, cstring name, s32 value) {
+    return program_bind_index(program, program_find_variable(program, name), value);
+}
+
+s32
+program_run(Program* program) {
+    switch (program->backend) {
+        case ProgramBackend_Interp: {
+            Interp_Scope* scope = &program->interp.scopes[0];
+            for_array(program->variables, var, _) {
+                Value value = {};
+                value.type = Value_integer;
+                value.integer = var->value;
+                map_put(scope->locals, var->ident, value);
+            }
+            program->interp.runtime_error = 0;
+            s32 result = interp_expression(&program->interp, program->ast).integer;
+            program->runtime_error = program->interp.runtime_error;
+            return program->runtime_error ? 0 : result;
+        } break;
+        
+        case ProgramBackend_Closure: {
+            memcpy(program->closure_slots, program->closure_bindings,
+                   program->closure.slot_count*sizeof(s32));
+            s32 result = closure_execute(&program->closure, program->closure_slots);
+            program->runtime_error = program->closure.runtime_error;
+            return result;
+        } break;
+        
+        case ProgramBackend_Vm: {
+            s32 result = vm_execute(&program->vm, program->bc.instructions,
+                                    array_count(program->bc.instructions));
+            program->runtime_error = program->vm.runtime_error;
+            return result;
+        } break;
+        
+        case ProgramBackend_Jit: {
+            s32 result;
+            program->runtime_error = jit_call_checked(program->jit_func, program->jit_arguments, &result);
+            return result;
+        } break;
+        
+        case ProgramBackend_Tiered: {
+            // NOTE(Alexander): the function may be published by the JIT thread at any time
+            asm_main* func = (asm_main*) atomic_load_pointer(&program->jit_func);
+            if (func) {
+                if (!program->stats.promoted_at_run) {
+                    program->stats.promoted_at_run = program->stats.run_counts[ProgramTier_Vm];
+                    if (program->stats.queued_at_run) {
+                        program->stats.jit_compile_seconds = program->jit_job.compile_seconds;
+                    }
+                }
+                program->stats.run_counts[ProgramTier_Jit]++;
+                s32 result;
+                program->runtime_error = jit_call_checked(func, program->jit_arguments, &result);
+                return result;
+            }
+            
+            u64 run_count = ++program->stats.run_counts[ProgramTier_Vm];
+            s32 result = vm_execute(&program->vm, program->bc.instructions,
+                                    array_count(program->bc.instructions));
+            program->runtime_error = program->vm.runtime_error;
+            
+            // NOTE(Alexander): programs that don't fit in jit_call stay in the VM
+            if (run_count == (u64) program->jit_threshold &&
+                program->parameter_count <= JIT_CALL_MAX_ARGUMENTS) {
+                if (program->jit_queue) {
+                    program->jit_job.instructions = program->bc.instructions;
+                    program->jit_job.target = &program->jit_func;
+                    jit_queue_submit(program->jit_queue, &program->jit_job);
+                    program->stats.queued_at_run = run_count;
+                } else {
+                    program_compile_jit(program);
+                }
+            }
+            return result;
+        } break;
+    }
+    
+    return 0;
+}
+
+void
+program_print_stats(Program* program) {
+    Program_Stats* stats = &program->stats;
+    pln("Program % stats:", f_cstring(program_backend_names[program->backend]));
+    for (int tier = 0; tier < ProgramTier_Count; tier++) {
+        pln("  % runs: %", f_cstring(program_tier_names[tier]), f_u64(stats->run_counts[tier]));
+    }
+    if (stats->queued_at_run) {
+        pln("  queued for background compilation after % runs", f_u64(stats->queued_at_run));
+    }
+    if (stats->promoted_at_run) {
+        pln("  promoted to the JIT after % runs, compiled in % ms",
+            f_u64(stats->promoted_at_run), f_float(stats->jit_compile_seconds*1e3));
+    } else {
+        pln("  not promoted (threshold is % runs)", f_int(program->jit_threshold));
+    }
+}
+
+void
+program_destroy(Program* program) {
+    if (!program) return;
+    
+    if (program->jit_job.state != JitJob_None) {
+        jit_queue_wait(program->jit_queue, &program->jit_job);
+    }
+    
+    if (program->interp.scopes) {
+        map_free(program->interp.scopes[0].locals);
+        array_free(program->interp.scopes);
+    }
+    closure_free(&program->closure);
+    free(program->closure_slots);
+    free(program->closure_bindings);
+    vm_free(&program->vm);
+    jit_free_executable(program->jit_func);
+    
+    array_free(program->variables);
+    if (program->ast) {
+        array_free(program->ast->Block.exprs);
+        array_free(program->ast->Block.lines);
+    }
+    array_free(program->bc.instructions);
+    map_free(program->bc.locals);
+    arena_free_all(&program->ast_arena);
+    interner_free(&program->interner);
+    free(program);
+}
@@ -52,7 +52,7 @@ is_number(u8 c) {
 
 inline void
 scan_while(Tokenizer* tokenizer, bool predicate(u8)) {
-    while (predicate(*tokenizer->curr) && tokenizer->curr <= tokenizer->end) {
+    while (tokenizer->curr < tokenizer->end && predicate(*tokenizer->curr)) {
         tokenizer->curr++;
     }
 }
@@ -0,0 +1,581 @@
+
+// Bytecode virtual machine, executes Bc_Instruction arrays directly using
+// a flat s32 register file (indexed by register number) and a stack region
+// for the slots created by Bytecode_push.
+//
+// Pointers (BcType_s32_ptr) are represented as slot indices into the stack.
+// The initial value of every stack slot is taken from bindings, which is
+// all zeros unless the embedder binds variables, see vm_bind.
+//
+// A division that traps (see division_traps) stops the run, it returns 0
+// and sets vm->runtime_error.
+
+#if defined(__GNUC__) || defined(__clang__)
+#define VM_COMPUTED_GOTO 1
+#else
+#define VM_COMPUTED_GOTO 0
+#endif
+
+struct Vm {
+    s32* registers;
+    u32 register_count;
+    
+    s32* stack;
+    s32* bindings;
+    u32 stack_count;
+    
+    cstring runtime_error; // set when the last run trapped, 0 otherwise
+};
+
+void
+vm_initialize(Vm* vm, array(Bc_Instruction)* instructions, u32 register_count) {
+    u32 stack_count = 0;
+    for_array(instructions, insn, _) {
+        if (insn->opcode == Bytecode_push) {
+            stack_count += (u32) (insn->src0.Signed_Int / sizeof(s32));
+        }
+    }
+    
+    vm->register_count = register_count;
+    vm->registers = (s32*) calloc(max(register_count, 1), sizeof(s32));
+    vm->stack_count = stack_count;
+    vm->stack = (s32*) calloc(max(stack_count, 1), sizeof(s32));
+    vm->bindings = (s32*) calloc(max(stack_count, 1), sizeof(s32));
+}
+
+void
+vm_free(Vm* vm) {
+    free(vm->registers);
+    free(vm->stack);
+    free(vm->bindings);
+    *vm = {};
+}
+
+// NOTE(Alexander): finds the stack slot that is pushed for the given s32* register, or -1
+s32
+vm_find_slot(array(Bc_Instruction)* instructions, u32 reg) {
+    s32 sp = 0;
+    for_array(instructions, insn, _) {
+        if (insn->opcode == Bytecode_push) {
+            if (insn->dest.Register == reg) {
+                return sp;
+            }
+            sp += insn->src0.Signed_Int / (s32) sizeof(s32);
+        }
+    }
+    return -1;
+}
+
+inline void
+vm_bind(Vm* vm, s32 slot, s32 value) {
+    assert(slot >= 0 && (u32) slot < vm->stack_count);
+    vm->bindings[slot] = value;
+}
+
+#define VM_OPERAND(op) ((op).kind == BcOperand_Int ? (op).Signed_Int : regs[(op).Register])
+
+// NOTE(Alexander): every execute function has a vm_trap label that stops the run
+#define VM_DIVIDE(dest, lhs, rhs) { \
+s32 dividend = lhs; \
+s32 divisor = rhs; \
+if (division_traps(dividend, divisor)) goto vm_trap; \
+dest = dividend / divisor; \
+}
+
+s32
+vm_execute(Vm* vm, Bc_Instruction* instructions, smm count) {
+    s32* regs = vm->registers;
+    s32* stack = vm->stack;
+    s32* bindings = vm->bindings;
+    s32 sp = 0;
+    s32 result = 0;
+    vm->runtime_error = 0;
+    
+    if (count <= 0) {
+        return result;
+    }
+    
+    Bc_Instruction* insn = instructions;
+    Bc_Instruction* end = instructions + count;
+    
+#if VM_COMPUTED_GOTO
+    // NOTE(Alexander): each handler jumps directly to the next handler,
+    // this gives the branch predictor one indirect jump per opcode.
+    static void* dispatch_table[] = {
+        &&vm_noop, &&vm_push, &&vm_load, &&vm_store,
+        &&vm_add, &&vm_sub, &&vm_mul, &&vm_div,
+        &&vm_shl, &&vm_shr, &&vm_sar, &&vm_mulhi, &&vm_ret,
+        &&vm_add_imm, &&vm_sub_imm, &&vm_mul_imm, &&vm_div_imm,
+        &&vm_add_load, &&vm_sub_load, &&vm_mul_load, &&vm_div_load,
+        &&vm_store_imm, &&vm_ret_add, &&vm_ret_sub, &&vm_ret_mul, &&vm_ret_div
+    };
+    
+#define VM_CASE(name) vm_##name:
+#define VM_NEXT() if (++insn == end) goto vm_halt; goto *dispatch_table[insn->opcode]
+    goto *dispatch_table[insn->opcode];
+#else
+#define VM_CASE(name) case Bytecode_##name:
+#define VM_NEXT() if (++insn == end) goto vm_halt; continue
+    for (;;) switch (insn->opcode) {
+#endif
+        
+        VM_CASE(noop) {
+            VM_NEXT();
+        }
+        
+        VM_CASE(push) { // dest = (s32*) SP; SP -= src0
+            regs[insn->dest.Register] = sp;
+            stack[sp] = bindings[sp];
+            sp += insn->src0.Signed_Int / (s32) sizeof(s32);
+            VM_NEXT();
+        }
+        
+        VM_CASE(load) { // dest = *src0
+            regs[insn->dest.Register] = stack[regs[insn->src0.Register]];
+            VM_NEXT();
+        }
+        
+        VM_CASE(store) { // *src0 = src1
+            stack[regs[insn->src0.Register]] = VM_OPERAND(insn->src1);
+            VM_NEXT();
+        }
+        
+#define VM_BINARY_CASE(name, op_symbol) \
+VM_CASE(name) { \
+regs[insn->dest.Register] = VM_OPERAND(insn->src0) op_symbol VM_OPERAND(insn->src1); \
+VM_NEXT(); \
+}
+
+        VM_BINARY_CASE(add, +);
+        VM_BINARY_CASE(sub, -);
+        VM_BINARY_CASE(mul, *);
+#undef VM_BINARY_CASE
+        
+        VM_CASE(div) {
+            VM_DIVIDE(regs[insn->dest.Register], VM_OPERAND(insn->src0), VM_OPERAND(insn->src1));
+            VM_NEXT();
+        }
+        
+#define VM_CALL_CASE(name) \
+VM_CASE(name) { \
+regs[insn->dest.Register] = bc_##name(VM_OPERAND(insn->src0), VM_OPERAND(insn->src1)); \
+VM_NEXT(); \
+}
+
+        VM_CALL_CASE(shl);
+        VM_CALL_CASE(shr);
+        VM_CALL_CASE(sar);
+        VM_CALL_CASE(mulhi);
+#undef VM_CALL_CASE
+        
+        VM_CASE(ret) { // returns src0
+            if (insn->src0.type == BcType_s32_ptr) {
+                result = stack[regs[insn->src0.Register]];
+            } else {
+                result = VM_OPERAND(insn->src0);
+            }
+            goto vm_halt;
+        }
+        
+        // Superinstructions
+#define VM_SUPERINSTRUCTION_CASES(name, op_symbol) \
+VM_CASE(name##_imm) { \
+regs[insn->dest.Register] = regs[insn->src0.Register] op_symbol insn->src1.Signed_Int; \
+VM_NEXT(); \
+} \
+VM_CASE(name##_load) { \
+regs[insn->dest.Register] = regs[insn->src0.Register] op_symbol stack[regs[insn->src1.Register]]; \
+VM_NEXT(); \
+} \
+VM_CASE(ret_##name) { \
+result = VM_OPERAND(insn->src0) op_symbol VM_OPERAND(insn->src1); \
+goto vm_halt; \
+}
+
+        VM_SUPERINSTRUCTION_CASES(add, +);
+        VM_SUPERINSTRUCTION_CASES(sub, -);
+        VM_SUPERINSTRUCTION_CASES(mul, *);
+#undef VM_SUPERINSTRUCTION_CASES
+        
+        VM_CASE(div_imm) {
+            VM_DIVIDE(regs[insn->dest.Register], regs[insn->src0.Register], insn->src1.Signed_Int);
+            VM_NEXT();
+        }
+        
+        VM_CASE(div_load) {
+            VM_DIVIDE(regs[insn->dest.Register], regs[insn->src0.Register], stack[regs[insn->src1.Register]]);
+            VM_NEXT();
+        }
+        
+        VM_CASE(ret_div) {
+            VM_DIVIDE(result, VM_OPERAND(insn->src0), VM_OPERAND(insn->src1));
+            goto vm_halt;
+        }
+        
+        VM_CASE(store_imm) { // *src0 = imm src1
+            stack[regs[insn->src0.Register]] = insn->src1.Signed_Int;
+            VM_NEXT();
+        }
+        
+#if !VM_COMPUTED_GOTO
+        default: {
+            assert(0 && "invalid bytecode opcode");
+            goto vm_halt;
+        }
+    }
+#endif
+
+#undef VM_CASE
+#undef VM_NEXT
+    
+    vm_halt:
+    return result;
+    
+    vm_trap:
+    vm->runtime_error = RUNTIME_ERROR_DIVISION;
+    return 0;
+}
+
+// NOTE(Alexander): executes a single instruction with any operand kinds,
+// returns true if the instruction halts the program, this includes a trap.
+inline bool
+vm_execute_instruction(Vm* vm, Bc_Instruction* insn, s32* sp, s32* result) {
+    s32* regs = vm->registers;
+    s32* stack = vm->stack;
+    
+    switch (insn->opcode) {
+        case Bytecode_noop: break;
+        
+        case Bytecode_push: {
+            regs[insn->dest.Register] = *sp;
+            stack[*sp] = vm->bindings[*sp];
+            *sp += insn->src0.Signed_Int / (s32) sizeof(s32);
+        } break;
+        
+        case Bytecode_load: {
+            regs[insn->dest.Register] = stack[regs[insn->src0.Register]];
+        } break;
+        
+        case Bytecode_store: {
+            stack[regs[insn->src0.Register]] = VM_OPERAND(insn->src1);
+        } break;
+        
+#define VM_BINARY_CASE(name, op_symbol) \
+case Bytecode_##name: { \
+regs[insn->dest.Register] = VM_OPERAND(insn->src0) op_symbol VM_OPERAND(insn->src1); \
+} break
+        
+        VM_BINARY_CASE(add, +);
+        VM_BINARY_CASE(sub, -);
+        VM_BINARY_CASE(mul, *);
+#undef VM_BINARY_CASE
+        
+        case Bytecode_div: {
+            VM_DIVIDE(regs[insn->dest.Register], VM_OPERAND(insn->src0), VM_OPERAND(insn->src1));
+        } break;
+        
+#define VM_CALL_CASE(name) \
+case Bytecode_##name: { \
+regs[insn->dest.Register] = bc_##name(VM_OPERAND(insn->src0), VM_OPERAND(insn->src1)); \
+} break
+        
+        VM_CALL_CASE(shl);
+        VM_CALL_CASE(shr);
+        VM_CALL_CASE(sar);
+        VM_CALL_CASE(mulhi);
+#undef VM_CALL_CASE
+        
+        case Bytecode_ret: {
+            if (insn->src0.type == BcType_s32_ptr) {
+                *result = stack[regs[insn->src0.Register]];
+            } else {
+                *result = VM_OPERAND(insn->src0);
+            }
+            return true;
+        }
+        
+#define VM_SUPERINSTRUCTION_CASES(name, op_symbol) \
+case Bytecode_##name##_imm: { \
+regs[insn->dest.Register] = regs[insn->src0.Register] op_symbol insn->src1.Signed_Int; \
+} break; \
+case Bytecode_##name##_load: { \
+regs[insn->dest.Register] = regs[insn->src0.Register] op_symbol stack[regs[insn->src1.Register]]; \
+} break; \
+case Bytecode_ret_##name: { \
+*result = VM_OPERAND(insn->src0) op_symbol VM_OPERAND(insn->src1); \
+return true; \
+}
+
+        VM_SUPERINSTRUCTION_CASES(add, +);
+        VM_SUPERINSTRUCTION_CASES(sub, -);
+        VM_SUPERINSTRUCTION_CASES(mul, *);
+#undef VM_SUPERINSTRUCTION_CASES
+        
+        case Bytecode_div_imm: {
+            VM_DIVIDE(regs[insn->dest.Register], regs[insn->src0.Register], insn->src1.Signed_Int);
+        } break;
+        
+        case Bytecode_div_load: {
+            VM_DIVIDE(regs[insn->dest.Register], regs[insn->src0.Register], stack[regs[insn->src1.Register]]);
+        } break;
+        
+        case Bytecode_ret_div: {
+            VM_DIVIDE(*result, VM_OPERAND(insn->src0), VM_OPERAND(insn->src1));
+            return true;
+        }
+        
+        case Bytecode_store_imm: {
+            stack[regs[insn->src0.Register]] = insn->src1.Signed_Int;
+        } break;
+        
+        default: {
+            assert(0 && "invalid bytecode opcode");
+            return true;
+        }
+    }
+    
+    return false;
+    
+    vm_trap:
+    vm->runtime_error = RUNTIME_ERROR_DIVISION;
+    *result = 0;
+    return true;
+}
+
+// NOTE(Alexander): dynamic opcode and opcode-pair histograms, used to find
+// which instruction pairs are worth turning into superinstructions.
+struct Vm_Profile {
+    u64 dispatch_count;
+    u64 opcode_counts[Bytecode_Count];
+    u64 pair_counts[Bytecode_Count][Bytecode_Count];
+};
+
+s32
+vm_execute_profiled(Vm* vm, Bc_Instruction* instructions, smm count, Vm_Profile* profile) {
+    s32 sp = 0;
+    s32 result = 0;
+    vm->runtime_error = 0;
+    
+    Bc_Opcode prev_opcode = Bytecode_Count;
+    for (smm i = 0; i < count; i++) {
+        Bc_Instruction* insn = instructions + i;
+        profile->dispatch_count++;
+        profile->opcode_counts[insn->opcode]++;
+        if (prev_opcode != Bytecode_Count) {
+            profile->pair_counts[prev_opcode][insn->opcode]++;
+        }
+        prev_opcode = insn->opcode;
+        
+        if (vm_execute_instruction(vm, insn, &sp, &result)) {
+            break;
+        }
+    }
+    
+    return result;
+}
+
+struct Vm_Opcode_Pair {
+    u64 count;
+    Bc_Opcode first;
+    Bc_Opcode second;
+};
+
+int
+compare_opcode_pairs(const void* a, const void* b) {
+    u64 a_count = ((Vm_Opcode_Pair*) a)->count;
+    u64 b_count = ((Vm_Opcode_Pair*) b)->count;
+    return (a_count < b_count) - (a_count > b_count);
+}
+
+void
+vm_print_profile(Vm_Profile* profile, int max_pairs) {
+    array(Vm_Opcode_Pair)* pairs = 0;
+    u64 pair_total = 0;
+    for (int first = 0; first < Bytecode_Count; first++) {
+        for (int second = 0; second < Bytecode_Count; second++) {
+            u64 count = profile->pair_counts[first][second];
+            if (count > 0) {
+                Vm_Opcode_Pair pair = { count, (Bc_Opcode) first, (Bc_Opcode) second };
+                array_push(pairs, pair);
+                pair_total += count;
+            }
+        }
+    }
+    qsort(pairs, array_count(pairs), sizeof(Vm_Opcode_Pair), compare_opcode_pairs);
+    
+    pln("VM profile: % dispatches", f_u64(profile->dispatch_count));
+    for (int i = 0; i < array_count(pairs) && i < max_pairs; i++) {
+        Vm_Opcode_Pair* pair = pairs + i;
+        pln("  % -> %: % (% %%)", f_cstring(opcode_names[pair->first]),
+            f_cstring(opcode_names[pair->second]), f_u64(pair->count),
+            f_float(100.0 * (f64) pair->count / (f64) pair_total));
+    }
+    array_free(pairs);
+}
+
+// NOTE(Alexander): executes the compact encoding directly, every form has its
+// own handler so the operand kinds are known without checking them at runtime.
+s32
+vm_execute_compact(Vm* vm, Bc_Compact_Program* program) {
+    s32* regs = vm->registers;
+    s32* stack = vm->stack;
+    s32 sp = 0;
+    s32 result = 0;
+    vm->runtime_error = 0;
+    
+    u8* ip = program->bytes;
+    u8* end = program->bytes + array_count(program->bytes);
+    if (ip == end) {
+        return result;
+    }
+    
+#if VM_COMPUTED_GOTO
+    static void* dispatch_table[] = {
+#define COMPACT(name, ...) &&vm_compact_##name,
+        DEF_COMPACT_FORMS
+#undef COMPACT
+        &&vm_compact_generic
+    };
+    
+#define VM_CASE(name) vm_compact_##name:
+#define VM_NEXT() if (ip == end) goto vm_halt; goto *dispatch_table[*ip++]
+    VM_NEXT();
+#else
+#define VM_CASE(name) case BcCompact_##name:
+#define VM_NEXT() if (ip == end) goto vm_halt; continue
+    for (;;) switch (*ip++) {
+#endif
+
+#define VM_REG() regs[bc_read_varint(&ip)]
+#define VM_INT() bc_zigzag_decode(bc_read_varint(&ip))
+        
+        VM_CASE(noop) {
+            VM_NEXT();
+        }
+        
+        VM_CASE(push) {
+            u32 dest = bc_read_varint(&ip);
+            s32 size = VM_INT();
+            regs[dest] = sp;
+            stack[sp] = vm->bindings[sp];
+            sp += size / (s32) sizeof(s32);
+            VM_NEXT();
+        }
+        
+        VM_CASE(load) {
+            u32 dest = bc_read_varint(&ip);
+            regs[dest] = stack[VM_REG()];
+            VM_NEXT();
+        }
+        
+        VM_CASE(store_r) {
+            s32 ptr = VM_REG();
+            stack[ptr] = VM_REG();
+            VM_NEXT();
+        }
+        
+        VM_CASE(store_i) {
+            s32 ptr = VM_REG();
+            stack[ptr] = VM_INT();
+            VM_NEXT();
+        }
+        
+#define VM_BINARY_CASE(name, op_symbol, read_src0, read_src1) \
+VM_CASE(name) { \
+u32 dest = bc_read_varint(&ip); \
+s32 src0 = read_src0; \
+s32 src1 = read_src1; \
+regs[dest] = src0 op_symbol src1; \
+VM_NEXT(); \
+}
+
+#define VM_BINARY_CASES(name, op_symbol) \
+VM_BINARY_CASE(name##_rr, op_symbol, VM_REG(), VM_REG()) \
+VM_BINARY_CASE(name##_ri, op_symbol, VM_REG(), VM_INT()) \
+VM_BINARY_CASE(name##_ir, op_symbol, VM_INT(), VM_REG()) \
+VM_BINARY_CASE(name##_ii, op_symbol, VM_INT(), VM_INT())
+        
+        VM_BINARY_CASES(add, +);
+        VM_BINARY_CASES(sub, -);
+        VM_BINARY_CASES(mul, *);
+#undef VM_BINARY_CASES
+#undef VM_BINARY_CASE
+
+#define VM_DIVIDE_CASE(name, read_src0, read_src1) \
+VM_CASE(name) { \
+u32 dest = bc_read_varint(&ip); \
+s32 src0 = read_src0; \
+s32 src1 = read_src1; \
+VM_DIVIDE(regs[dest], src0, src1); \
+VM_NEXT(); \
+}
+
+        VM_DIVIDE_CASE(div_rr, VM_REG(), VM_REG());
+        VM_DIVIDE_CASE(div_ri, VM_REG(), VM_INT());
+        VM_DIVIDE_CASE(div_ir, VM_INT(), VM_REG());
+        VM_DIVIDE_CASE(div_ii, VM_INT(), VM_INT());
+#undef VM_DIVIDE_CASE
+        
+        // NOTE(Alexander): strength reduction only emits these with an immediate src1
+#define VM_CALL_CASE(name) \
+VM_CASE(name##_ri) { \
+u32 dest = bc_read_varint(&ip); \
+s32 src0 = VM_REG(); \
+regs[dest] = bc_##name(src0, VM_INT()); \
+VM_NEXT(); \
+}
+
+        VM_CALL_CASE(shl);
+        VM_CALL_CASE(shr);
+        VM_CALL_CASE(sar);
+        VM_CALL_CASE(mulhi);
+#undef VM_CALL_CASE
+        
+        VM_CASE(ret_r) {
+            bc_read_varint(&ip);
+            result = VM_REG();
+            goto vm_halt;
+        }
+        
+        VM_CASE(ret_p) {
+            bc_read_varint(&ip);
+            result = stack[VM_REG()];
+            goto vm_halt;
+        }
+        
+        VM_CASE(ret_i) {
+            bc_read_varint(&ip);
+            result = VM_INT();
+            goto vm_halt;
+        }
+        
+        VM_CASE(generic) {
+            ip--;
+            Bc_Instruction insn = bc_compact_decode_instruction(&ip);
+            if (vm_execute_instruction(vm, &insn, &sp, &result)) {
+                goto vm_halt;
+            }
+            VM_NEXT();
+        }
+        
+#undef VM_REG
+#undef VM_INT
+
+#if !VM_COMPUTED_GOTO
+        default: {
+            assert(0 && "invalid compact opcode");
+            goto vm_halt;
+        }
+    }
+#endif
+
+#undef VM_CASE
+#undef VM_NEXT
+    
+    vm_halt:
+    return result;
+    
+    vm_trap:
+    vm->runtime_error = RUNTIME_ERROR_DIVISION;
+    return 0;
+}
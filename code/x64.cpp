@@ -6,12 +6,20 @@ enum X64_Opcode {
     X64Opcode_add,  // op0 += op1
     X64Opcode_sub,  // op0 -= op1
     X64Opcode_imul, // op0 *= op1
-    X64Opcode_idiv, // op0 /= op1
+    X64Opcode_idiv, // eax = edx:eax / op0, edx = remainder
+    X64Opcode_cdq,  // edx = sign extension of eax
+    X64Opcode_shl,  // op0 <<= op1
+    X64Opcode_shr,  // op0 >>= op1 (logical)
+    X64Opcode_sar,  // op0 >>= op1 (arithmetic)
+    X64Opcode_movsxd, // op0 = sign extended op1, always 64-bit
+    X64Opcode_push, // pushes the 64-bit op0
+    X64Opcode_pop,  // pops the 64-bit op0
     X64Opcode_ret,  // returns RAX (on windows)
+    X64Opcode_Count,
 };
 
 const cstring x64_opcode_name_table[] = {
-    "noop", "int3", "mov", "add", "sub", "mul", "div", "ret"
+    "noop", "int3", "mov", "add", "sub", "mul", "div", "cdq", "shl", "shr", "sar", "movsxd", "push", "pop", "ret"
 };
 
 enum X64_Operand_Kind {
@@ -41,12 +49,48 @@ enum X64_Register {
     X64Register_rbp,
     X64Register_rsi,
     X64Register_rdi,
+    X64Register_r8,
+    X64Register_r9,
+    X64Register_r10,
+    X64Register_r11,
+    X64Register_r12,
+    X64Register_r13,
+    X64Register_r14,
+    X64Register_r15,
 };
 
 const cstring x64_register_name_table[] = {
-    "eax", "ecx", "edx", "ebx", "rsp", "rbp", "esi", "edi"
+    "eax", "ecx", "edx", "ebx", "rsp", "rbp", "esi", "edi",
+    "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"
 };
 
+// NOTE(Alexander): integer argument registers, the remaining arguments are passed on the stack
+#if defined(BUILD_WINDOWS)
+global const X64_Register x64_argument_registers[] = {
+    X64Register_rcx, X64Register_rdx, X64Register_r8, X64Register_r9
+};
+#define X64_STACK_ARGUMENTS_OFFSET 48 // saved rbp + return address + shadow space
+#define X64_STACK_PAGE_SIZE 4096
+#define X64_CALLEE_SAVED_REGISTERS (bit(X64Register_rbx) | bit(X64Register_rsp) | bit(X64Register_rbp) | \
+bit(X64Register_rsi) | bit(X64Register_rdi) | \
+bit(X64Register_r12) | bit(X64Register_r13) | \
+bit(X64Register_r14) | bit(X64Register_r15))
+#else
+global const X64_Register x64_argument_registers[] = {
+    X64Register_rdi, X64Register_rsi, X64Register_rdx,
+    X64Register_rcx, X64Register_r8, X64Register_r9
+};
+#define X64_STACK_ARGUMENTS_OFFSET 16 // saved rbp + return address
+#define X64_CALLEE_SAVED_REGISTERS (bit(X64Register_rbx) | bit(X64Register_rsp) | bit(X64Register_rbp) | \
+bit(X64Register_r12) | bit(X64Register_r13) | \
+bit(X64Register_r14) | bit(X64Register_r15))
+#endif
+
+inline bool
+x64_is_callee_saved(X64_Register reg) {
+    return is_bit_set(X64_CALLEE_SAVED_REGISTERS, reg);
+}
+
 struct X64_Operand {
     X64_Operand_Kind kind;
     union {
@@ -63,17 +107,43 @@ struct X64_Instruction {
     X64_Operand op0;
     X64_Operand op1;
     X64_Encoding encoding;
+    b32 is_64bit; // REX.W, operates on the full 64-bit registers
+    u32 line; // source line of the statement, 0 for the prologue and the argument copies
 };
 
 struct X64_Builder {
     array(X64_Instruction)* instructions;
     map(u32, s32)* stack_offsets;
     s32 stack_pointer;
+    
+    array(u32)* parameters; // push registers of the free variables, in argument order
+    u32 next_virtual_register; // virtual registers that don't exist in the bytecode start here
+    u32 line; // line of the bytecode instruction that is being converted
 };
 
+inline X64_Operand
+x64_register_operand(X64_Register reg) {
+    X64_Operand result = {};
+    result.kind = X64Operand_r32;
+    result.reg_allocated = reg;
+    result.is_allocated = true;
+    return result;
+}
+
+inline X64_Operand
+x64_memory_operand(X64_Register base, s32 displacement) {
+    X64_Operand result = {};
+    result.kind = X64Operand_m32;
+    result.reg_allocated = base;
+    result.displacement = displacement;
+    result.is_allocated = true;
+    return result;
+}
+
 inline void
 x64_push_instruction(X64_Builder* x64, X64_Instruction insn) {
     insn.encoding = bit(insn.op0.kind) | bit(insn.op1.kind + 3);
+    insn.line = x64->line;
     array_push(x64->instructions, insn);
 }
 
@@ -109,21 +179,20 @@ x64_build_operand(X64_Builder* x64, Bc_Operand operand) {
 }
 
 void
-x64_push_instruction(X64_Builder* x64, X64_Opcode opcode, Bc_Operand op0, Bc_Operand op1) {
+x64_push_instruction(X64_Builder* x64, X64_Opcode opcode, Bc_Operand op0, Bc_Operand op1, bool is_64bit=false) {
     X64_Instruction insn = {};
     insn.opcode = opcode;
     insn.op0 = x64_build_operand(x64, op0);
     insn.op1 = x64_build_operand(x64, op1);
+    insn.is_64bit = is_64bit;
     x64_push_instruction(x64, insn);
 }
 
 void
 convert_to_x64_instruction(X64_Builder* x64, Bc_Instruction* bc) {
     switch (bc->opcode) {
-        case Bytecode_push: { // dest = push src0
-            x64->stack_pointer -= bc->src0.Signed_Int;
-            map_put(x64->stack_offsets, bc->dest.Register, x64->stack_pointer);
-        } break;
+        case Bytecode_noop: break;
+        case Bytecode_push: break; // stack slots are assigned in the prologue
         
         case Bytecode_store: { // *src0 = src1 -> mov [src0], src1
             x64_push_instruction(x64, X64Opcode_mov, bc->src0, bc->src1);
@@ -140,7 +209,7 @@ convert_to_x64_instruction(X64_Builder* x64, Bc_Instruction* bc) {
         
         case Bytecode_sub: { // dest = src1; dest -= src2
             x64_push_instruction(x64, X64Opcode_mov, bc->dest, bc->src0);
-            x64_push_instruction(x64, X64Opcode_add, bc->dest, bc->src1);
+            x64_push_instruction(x64, X64Opcode_sub, bc->dest, bc->src1);
         } break;
         
         case Bytecode_mul: { // dest = src1; dest *= src2
@@ -148,6 +217,77 @@ convert_to_x64_instruction(X64_Builder* x64, Bc_Instruction* bc) {
             x64_push_instruction(x64, X64Opcode_imul, bc->dest, bc->src1);
         } break;
         
+        // NOTE(Alexander): idiv divides edx:eax, so the dividend and the quotient are pinned
+        // to eax and edx is clobbered, the allocator keeps other values out of them
+        case Bytecode_div: { // mov eax, src0; cdq; idiv src1; mov dest, eax
+            X64_Operand divisor = x64_build_operand(x64, bc->src1);
+            if (divisor.kind == X64Operand_imm32) {
+                // NOTE(Alexander): idiv has no immediate form
+                X64_Instruction mov_insn = {};
+                mov_insn.opcode = X64Opcode_mov;
+                mov_insn.op0.kind = X64Operand_r32;
+                mov_insn.op0.reg = x64->next_virtual_register++;
+                mov_insn.op1 = divisor;
+                x64_push_instruction(x64, mov_insn);
+                divisor = mov_insn.op0;
+            }
+            
+            X64_Instruction insn = {};
+            insn.opcode = X64Opcode_mov;
+            insn.op0 = x64_register_operand(X64Register_rax);
+            insn.op1 = x64_build_operand(x64, bc->src0);
+            x64_push_instruction(x64, insn);
+            
+            insn = {};
+            insn.opcode = X64Opcode_cdq;
+            x64_push_instruction(x64, insn);
+            
+            insn = {};
+            insn.opcode = X64Opcode_idiv;
+            insn.op0 = divisor;
+            x64_push_instruction(x64, insn);
+            
+            insn = {};
+            insn.opcode = X64Opcode_mov;
+            insn.op0 = x64_build_operand(x64, bc->dest);
+            insn.op1 = x64_register_operand(X64Register_rax);
+            x64_push_instruction(x64, insn);
+        } break;
+        
+        // NOTE(Alexander): shift counts in a register would have to be in cl,
+        // strength reduction only emits shifts by an immediate
+        case Bytecode_shl: { // dest = src1; dest <<= imm src2
+            assert(bc->src1.kind == BcOperand_Int && "shift count has to be an immediate");
+            x64_push_instruction(x64, X64Opcode_mov, bc->dest, bc->src0);
+            x64_push_instruction(x64, X64Opcode_shl, bc->dest, bc->src1);
+        } break;
+        
+        case Bytecode_shr: { // dest = src1; dest >>= imm src2
+            assert(bc->src1.kind == BcOperand_Int && "shift count has to be an immediate");
+            x64_push_instruction(x64, X64Opcode_mov, bc->dest, bc->src0);
+            x64_push_instruction(x64, X64Opcode_shr, bc->dest, bc->src1);
+        } break;
+        
+        case Bytecode_sar: { // dest = src1; dest >>= imm src2
+            assert(bc->src1.kind == BcOperand_Int && "shift count has to be an immediate");
+            x64_push_instruction(x64, X64Opcode_mov, bc->dest, bc->src0);
+            x64_push_instruction(x64, X64Opcode_sar, bc->dest, bc->src1);
+        } break;
+        
+        case Bytecode_mulhi: { // movsxd dest, src1; imul dest, imm src2; sar dest, 32 (64-bit)
+            Bc_Operand lhs = bc->src0;
+            Bc_Operand rhs = bc->src1;
+            if (lhs.kind == BcOperand_Int) {
+                lhs = bc->src1;
+                rhs = bc->src0;
+            }
+            assert(lhs.kind == BcOperand_Register && rhs.kind == BcOperand_Int &&
+                   "mulhi is only lowered with an immediate");
+            x64_push_instruction(x64, X64Opcode_movsxd, bc->dest, lhs, true);
+            x64_push_instruction(x64, X64Opcode_imul, bc->dest, rhs, true);
+            x64_push_instruction(x64, X64Opcode_sar, bc->dest, bc_int_operand(32), true);
+        } break;
+        
         case Bytecode_ret: { // ret src0;
             X64_Operand rax = {};
             rax.kind = X64Operand_r32;
@@ -164,222 +304,955 @@ convert_to_x64_instruction(X64_Builder* x64, Bc_Instruction* bc) {
             ret_insn.opcode = X64Opcode_ret;
             x64_push_instruction(x64, ret_insn);
         } break;
+        
+        // NOTE(Alexander): the fused opcodes are only produced for the VM, see bc_fuse_superinstructions
+        default: {
+            assert(0 && "superinstructions are VM only");
+        } break;
     }
 }
 
 void
 convert_to_x64(X64_Builder* x64, array(Bc_Instruction)* instructions) {
-    // simple prologue, mov rbp, rsp (windows doesn't use rbp)
-    X64_Operand rbp = {};
-    rbp.kind = X64Operand_r32;
-    rbp.reg_allocated = X64Register_rbp;
-    rbp.is_allocated = true;
-    
-    X64_Operand rsp = {};
-    rsp.kind = X64Operand_r32;
-    rsp.reg_allocated = X64Register_rsp;
-    rsp.is_allocated = true;
-    
-    X64_Instruction mov_insn = {};
-    mov_insn.opcode = X64Opcode_mov;
-    mov_insn.op0 = rbp;
-    mov_insn.op1 = rsp;
-    x64_push_instruction(x64, mov_insn);
+    // NOTE(Alexander): the prologue and epilogue are added after register allocation,
+    // once the size of the frame is known, see x64_emit_frame
+    s32 register_count = 0;
+    for_array(instructions, insn, insn_index) {
+        if (insn->opcode == Bytecode_push) {
+            x64->stack_pointer -= insn->src0.Signed_Int;
+            map_put(x64->stack_offsets, insn->dest.Register, x64->stack_pointer);
+        }
+        if (insn->dest.kind == BcOperand_Register) {
+            register_count = max(register_count, (s32) insn->dest.Register + 1);
+        }
+    }
+    x64->next_virtual_register = register_count;
+    
+    // NOTE(Alexander): free variables are the function arguments, they are copied to
+    // their stack slots before any virtual register gets allocated.
+    x64->parameters = bc_find_free_variables(instructions, register_count);
+    for_array(x64->parameters, param, param_index) {
+        X64_Instruction store_insn = {};
+        store_insn.opcode = X64Opcode_mov;
+        store_insn.op0.kind = X64Operand_m32;
+        store_insn.op0.reg_allocated = X64Register_rbp;
+        store_insn.op0.displacement = map_get(x64->stack_offsets, *param);
+        store_insn.op0.is_allocated = true;
+        store_insn.op1.kind = X64Operand_r32;
+        store_insn.op1.is_allocated = true;
+        
+        if (param_index < fixed_array_count(x64_argument_registers)) {
+            store_insn.op1.reg_allocated = x64_argument_registers[param_index];
+        } else {
+            smm stack_index = param_index - fixed_array_count(x64_argument_registers);
+            X64_Instruction load_insn = {};
+            load_insn.opcode = X64Opcode_mov;
+            load_insn.op0.kind = X64Operand_r32;
+            load_insn.op0.reg_allocated = X64Register_rax;
+            load_insn.op0.is_allocated = true;
+            load_insn.op1.kind = X64Operand_m32;
+            load_insn.op1.reg_allocated = X64Register_rbp;
+            load_insn.op1.displacement = (s32) (X64_STACK_ARGUMENTS_OFFSET + stack_index*8);
+            load_insn.op1.is_allocated = true;
+            x64_push_instruction(x64, load_insn);
+            store_insn.op1.reg_allocated = X64Register_rax;
+        }
+        x64_push_instruction(x64, store_insn);
+    }
     
     for_array(instructions, insn, _) {
+        x64->line = insn->line;
         convert_to_x64_instruction(x64, insn);
     }
+    x64->line = 0;
 }
 
 
+inline bool
+x64_is_virtual_register(X64_Operand* operand) {
+    return operand->kind == X64Operand_r32 && !operand->is_allocated;
+}
+
+// NOTE(Alexander): only virtual registers are tracked, mov and movsxd overwrite op0
+// and every other two-operand instruction reads and writes op0.
 void
-allocate_x64_registers(array(X64_Instruction)* instructions) {
-    X64_Register free_regs[] = {
-        X64Register_rdi, X64Register_rsi, X64Register_rbx, 
-        X64Register_rdx, X64Register_rcx, X64Register_rax
-    };
-    int free_count = fixed_array_count(free_regs);
-    map(u32, X64_Register)* allocated_regs = 0;
-    
-    for (int i = 0; i < array_count(instructions); i++) {
-        X64_Instruction* curr = instructions + i;
-        
-        if (curr->op0.kind == X64Operand_r32 && !curr->op0.is_allocated) {
-            smm index = map_get_index(allocated_regs, curr->op0.reg);
-            if (index != -1) {
-                // Used in destination, it's fine just allow it
-                curr->op0.reg_allocated = allocated_regs[index].value;
-                curr->op0.is_allocated = true;
-            } else {
-                // Allocate
-                assert(free_count > 0 && "ran out of registers");
-                curr->op0.reg_allocated = free_regs[--free_count];
-                curr->op0.is_allocated = true;
-                map_put(allocated_regs, curr->op0.reg, curr->op0.reg_allocated);
+x64_live_operands(X64_Instruction* insn, Live_Operands* result) {
+    *result = {};
+    if (x64_is_virtual_register(&insn->op1)) {
+        live_add_use(result, insn->op1.reg);
+    }
+    if (x64_is_virtual_register(&insn->op0)) {
+        bool is_overwritten = insn->opcode == X64Opcode_mov || insn->opcode == X64Opcode_movsxd;
+        if (!is_overwritten) {
+            live_add_use(result, insn->op0.reg);
+        }
+        if (insn->op1.kind != X64Operand_None) {
+            live_add_def(result, insn->op0.reg);
+        }
+    }
+}
+
+Liveness
+x64_compute_liveness(array(X64_Instruction)* instructions) {
+    smm count = array_count(instructions);
+    u32 register_count = 0;
+    Live_Operands* operands = (Live_Operands*) malloc((umm) max(count, 1)*sizeof(Live_Operands));
+    for_array(instructions, insn, insn_index) {
+        x64_live_operands(insn, operands + insn_index);
+        if (x64_is_virtual_register(&insn->op0)) register_count = max(register_count, insn->op0.reg + 1);
+        if (x64_is_virtual_register(&insn->op1)) register_count = max(register_count, insn->op1.reg + 1);
+    }
+    
+    Liveness result = {};
+    liveness_compute_straight_line(&result, operands, count, register_count);
+    free(operands);
+    return result;
+}
+
+// Linear scan register allocation
+//
+// Virtual registers are assigned in the order their live intervals start.
+// When every register is taken the interval that ends last is spilled to
+// an 8 byte rbp slot, either the new interval as a whole or the rest of an
+// active one, which is split: it keeps its register before the current
+// instruction and is stored to its slot right before it. Spilled values are
+// used directly as memory operands when the instruction allows it, the
+// remaining cases go through a scratch register that is taken out of the
+// pool when the program spills. Values that are only ever a `mov r, imm`
+// are rematerialized as immediates instead of being stored.
+//
+// The two-address lowering turns `dest = src0 op src1` into `mov dest, src0`
+// followed by `op dest, src1`. The allocator hints dest to the register of
+// src0 when src0 dies at the mov, and values that end up in a fixed register
+// (e.g. the return value in eax) are hinted to it, so the copies coalesce
+// into `mov r, r` which is then deleted.
+//
+// Instructions that already use physical registers (the argument copies, the
+// return value, the eax/edx of idiv) give those registers fixed ranges, from
+// where they are written to where they are last read. A value never gets a
+// register whose fixed ranges overlap its interval.
+
+struct X64_Allocation_Stats {
+    s32 spill_count;  // intervals that are (partly) kept in memory
+    s32 split_count;  // spilled intervals that had a register before the spill
+    s32 store_count;  // stores to spill slots
+    s32 reload_count; // reads of spill slots
+    s32 remat_count;  // uses replaced by their constant
+    s32 coalesced_count; // register to register movs that were deleted
+    s32 saved_count;  // callee-saved registers that are saved and restored
+    s32 frame_size;   // bytes reserved below rbp for variables, spill slots and saved registers
+};
+
+enum X64_Location {
+    X64Location_None,
+    X64Location_Register,
+    X64Location_Memory,
+    X64Location_Constant,
+};
+
+struct X64_Allocator {
+    X64_Builder* x64;
+    array(X64_Instruction)* result;
+    X64_Allocation_Stats* stats;
+    Liveness liveness;
+    
+    X64_Location* locations;
+    X64_Register* registers;
+    s32* spill_offsets; // 0 until the value gets a slot
+    b32* is_constant;
+    s32* constants;
+    s32* hints; // preferred register, -1 if there is none
+    
+    array(Live_Interval)* fixed_ranges[X64Register_r15 + 1]; // sorted, see x64_compute_fixed_ranges
+    
+    X64_Register free_regs[16];
+    s32 free_count;
+    u32 active[16]; // virtual registers that have a register
+    s32 active_count;
+    
+    X64_Register scratch;
+    b32 use_scratch;
+    b32 needs_scratch; // spilled without a scratch register, the allocation has to be redone
+};
+
+inline void
+x64_emit(array(X64_Instruction)** instructions, X64_Opcode opcode, X64_Operand op0, X64_Operand op1, b32 is_64bit) {
+    X64_Instruction insn = {};
+    insn.opcode = opcode;
+    insn.op0 = op0;
+    insn.op1 = op1;
+    insn.is_64bit = is_64bit;
+    insn.encoding = bit(insn.op0.kind) | bit(insn.op1.kind + 3);
+    array_push(*instructions, insn);
+}
+
+s32
+x64_spill_slot(X64_Allocator* allocator, u32 reg) {
+    if (allocator->spill_offsets[reg] == 0) {
+        // NOTE(Alexander): 8 bytes, mulhi keeps a 64-bit value in its register
+        X64_Builder* x64 = allocator->x64;
+        x64->stack_pointer = (x64->stack_pointer & ~7) - 8;
+        allocator->spill_offsets[reg] = x64->stack_pointer;
+    }
+    return allocator->spill_offsets[reg];
+}
+
+void
+x64_spill(X64_Allocator* allocator, u32 reg, bool is_split) {
+    allocator->stats->spill_count++;
+    if (allocator->is_constant[reg]) {
+        allocator->locations[reg] = X64Location_Constant;
+        return;
+    }
+    
+    if (is_split) {
+        allocator->stats->split_count++;
+        allocator->stats->store_count++;
+        x64_emit(&allocator->result, X64Opcode_mov,
+                 x64_memory_operand(X64Register_rbp, x64_spill_slot(allocator, reg)),
+                 x64_register_operand(allocator->registers[reg]), true);
+    }
+    allocator->locations[reg] = X64Location_Memory;
+}
+
+// NOTE(Alexander): the physical registers an instruction reads and writes, including the implicit ones
+void
+x64_physical_operands(X64_Instruction* insn, u32* uses, u32* defs) {
+    *uses = 0;
+    *defs = 0;
+    switch (insn->opcode) {
+        case X64Opcode_cdq: {
+            *uses = bit(X64Register_rax);
+            *defs = bit(X64Register_rdx);
+        } break;
+        
+        case X64Opcode_idiv: {
+            *uses = bit(X64Register_rax) | bit(X64Register_rdx);
+            *defs = bit(X64Register_rax) | bit(X64Register_rdx);
+        } break;
+        
+        case X64Opcode_ret: {
+            *uses = bit(X64Register_rax);
+        } break;
+        
+        default: break;
+    }
+    
+    if (insn->op1.kind == X64Operand_r32 && insn->op1.is_allocated) {
+        *uses |= bit(insn->op1.reg_allocated);
+    }
+    if (insn->op0.kind == X64Operand_r32 && insn->op0.is_allocated) {
+        bool is_overwritten = insn->opcode == X64Opcode_mov || insn->opcode == X64Opcode_movsxd;
+        if (!is_overwritten) *uses |= bit(insn->op0.reg_allocated);
+        if (insn->op1.kind != X64Operand_None) *defs |= bit(insn->op0.reg_allocated);
+    }
+}
+
+// NOTE(Alexander): a backward scan, same as the liveness of the virtual registers. Writes that are
+// never read still get a range of one instruction since they clobber the register.
+void
+x64_compute_fixed_ranges(X64_Allocator* allocator, array(X64_Instruction)* instructions) {
+    u32 live = 0;
+    s32 ends[X64Register_r15 + 1];
+    for (smm index = array_count(instructions) - 1; index >= 0; index--) {
+        u32 uses, defs;
+        x64_physical_operands(instructions + index, &uses, &defs);
+        for (int reg = X64Register_rax; reg <= X64Register_r15; reg++) {
+            if (is_bit_set(defs, reg)) {
+                Live_Interval range = { (s32) index, is_bit_set(live, reg) ? ends[reg] : (s32) index };
+                array_push(allocator->fixed_ranges[reg], range);
+                live &= ~bit(reg);
             }
         }
+        for (int reg = X64Register_rax; reg <= X64Register_r15; reg++) {
+            if (is_bit_set(uses, reg) && !is_bit_set(live, reg)) {
+                live |= bit(reg);
+                ends[reg] = (s32) index;
+            }
+        }
+    }
+    
+    // NOTE(Alexander): the arguments are live on entry
+    for (int reg = X64Register_rax; reg <= X64Register_r15; reg++) {
+        if (is_bit_set(live, reg)) {
+            Live_Interval range = { -1, ends[reg] };
+            array_push(allocator->fixed_ranges[reg], range);
+        }
         
-        if (curr->op1.kind == X64Operand_r32 && !curr->op1.is_allocated) {
-            // Free after use
-            assert(free_count < fixed_array_count(free_reg));
-            curr->op1.reg_allocated = map_get(allocated_regs, curr->op1.reg);
-            curr->op1.is_allocated = true;
-            free_regs[free_count++] = curr->op1.reg_allocated;
+        // NOTE(Alexander): found backwards, reversed so the starts (and ends) are ascending
+        array(Live_Interval)* ranges = allocator->fixed_ranges[reg];
+        for (smm range_index = 0; range_index < array_count(ranges) / 2; range_index++) {
+            Live_Interval tmp = ranges[range_index];
+            ranges[range_index] = ranges[array_count(ranges) - 1 - range_index];
+            ranges[array_count(ranges) - 1 - range_index] = tmp;
         }
     }
 }
 
+// NOTE(Alexander): a value can use the register if it isn't live across any of its fixed ranges,
+// the value may end where a range starts (it's read before it's overwritten) and start where one ends
+bool
+x64_has_fixed_conflict(X64_Allocator* allocator, X64_Register reg, Live_Interval interval) {
+    array(Live_Interval)* ranges = allocator->fixed_ranges[reg];
+    smm low = 0;
+    smm high = array_count(ranges);
+    while (low < high) {
+        smm middle = (low + high) / 2;
+        if (ranges[middle].end <= interval.start) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low < array_count(ranges) && ranges[low].start < interval.end;
+}
 
-struct Machine_Code {
-    u8* bytes;
-    umm size;
-};
+// NOTE(Alexander): gives the interval starting at instruction index a register, spilling the
+// interval that ends last if there are none left. The hint is taken if it's free.
+void
+x64_allocate_interval(X64_Allocator* allocator, u32 reg, s32 index, s32 hint) {
+    Live_Interval* intervals = allocator->liveness.intervals;
+    
+    // NOTE(Alexander): mov and movsxd read op1 before op0 is written, so a value that is
+    // last used here can give its register to the new one
+    for (s32 active_index = 0; active_index < allocator->active_count; active_index++) {
+        u32 other = allocator->active[active_index];
+        if (intervals[other].end <= index) {
+            allocator->free_regs[allocator->free_count++] = allocator->registers[other];
+            allocator->active[active_index--] = allocator->active[--allocator->active_count];
+        }
+    }
+    
+    s32 chosen = -1;
+    for (s32 free_index = allocator->free_count - 1; free_index >= 0; free_index--) {
+        X64_Register candidate = allocator->free_regs[free_index];
+        if (x64_has_fixed_conflict(allocator, candidate, intervals[reg])) {
+            continue;
+        }
+        if (chosen < 0 || candidate == hint) {
+            chosen = free_index;
+        }
+        if (candidate == hint) {
+            break;
+        }
+    }
+    
+    X64_Register result;
+    if (chosen >= 0) {
+        result = allocator->free_regs[chosen];
+        allocator->free_regs[chosen] = allocator->free_regs[--allocator->free_count];
+    } else {
+        if (!allocator->use_scratch) {
+            allocator->needs_scratch = true;
+        }
+        
+        s32 victim_index = -1;
+        for (s32 active_index = 0; active_index < allocator->active_count; active_index++) {
+            u32 other = allocator->active[active_index];
+            if (x64_has_fixed_conflict(allocator, allocator->registers[other], intervals[reg])) {
+                continue;
+            }
+            if (victim_index < 0 || intervals[other].end > intervals[allocator->active[victim_index]].end) {
+                victim_index = active_index;
+            }
+        }
+        
+        if (victim_index < 0 || intervals[allocator->active[victim_index]].end <= intervals[reg].end) {
+            x64_spill(allocator, reg, false);
+            return;
+        }
+        
+        u32 victim = allocator->active[victim_index];
+        x64_spill(allocator, victim, true);
+        result = allocator->registers[victim];
+        allocator->active[victim_index] = allocator->active[--allocator->active_count];
+    }
+    
+    allocator->registers[reg] = result;
+    allocator->locations[reg] = X64Location_Register;
+    allocator->active[allocator->active_count++] = reg;
+}
 
+X64_Operand
+x64_resolve_operand(X64_Allocator* allocator, X64_Operand operand, bool is_read) {
+    if (!x64_is_virtual_register(&operand)) {
+        return operand;
+    }
+    
+    u32 reg = operand.reg;
+    switch (allocator->locations[reg]) {
+        case X64Location_Register: {
+            return x64_register_operand(allocator->registers[reg]);
+        }
+        
+        case X64Location_Memory: {
+            if (is_read) allocator->stats->reload_count++;
+            return x64_memory_operand(X64Register_rbp, x64_spill_slot(allocator, reg));
+        }
+        
+        case X64Location_Constant: {
+            if (is_read) allocator->stats->remat_count++;
+            X64_Operand result = {};
+            result.kind = X64Operand_imm32;
+            result.imm = allocator->constants[reg];
+            return result;
+        }
+        
+        default: break;
+    }
+    
+    assert(0 && "virtual register is used before it's defined");
+    return operand;
+}
+
+// NOTE(Alexander): rewrites an instruction with its allocated operands, the operand
+// combinations that x64 can't encode go through the scratch register
 void
-assemble_x64_instruction_to_machine_code(Machine_Code* code, X64_Instruction* insn) {
-    u8* curr = code->bytes + code->size;
+x64_emit_allocated(X64_Allocator* allocator, X64_Instruction* insn) {
+    bool is_overwritten = insn->opcode == X64Opcode_mov || insn->opcode == X64Opcode_movsxd;
+    X64_Operand op0 = x64_resolve_operand(allocator, insn->op0, !is_overwritten);
+    X64_Operand op1 = x64_resolve_operand(allocator, insn->op1, true);
+    X64_Operand scratch = x64_register_operand(allocator->scratch);
+    array(X64_Instruction)** result = &allocator->result;
+    
+    // NOTE(Alexander): the value was rematerialized, so its definition isn't needed.
+    // op0 of the other opcodes is never a constant, it's either written too or it's
+    // the idiv divisor, which allocate_x64_registers excludes.
+    if (op0.kind == X64Operand_imm32) {
+        assert(insn->opcode == X64Opcode_mov && "only mov can define a constant");
+        return;
+    }
     
-    if (insn->opcode == X64Opcode_ret) {
-        *curr++ = 0xC3; // near return
-        code->size++;
+    // NOTE(Alexander): dest and src were coalesced, a 32-bit mov would zero the upper half
+    // but nothing reads the upper half of a 32-bit value
+    if (insn->opcode == X64Opcode_mov && op0.kind == X64Operand_r32 && op1.kind == X64Operand_r32 &&
+        op0.reg_allocated == op1.reg_allocated &&
+        (x64_is_virtual_register(&insn->op0) || x64_is_virtual_register(&insn->op1))) {
+        allocator->stats->coalesced_count++;
         return;
     }
     
-    // REX
-    if (insn->op1.reg_allocated == X64Register_rsp) {
-        *curr++ = 0b01001000;
+    if (op0.kind == X64Operand_m32 && x64_is_virtual_register(&insn->op0)) {
+        allocator->stats->store_count++;
     }
     
-    // opcode
-    u8 reg = 0;
     switch (insn->opcode) {
-        case X64Opcode_mov: {
-            switch (insn->encoding) {
-                case X64Encoding_mr: *curr++ = 0x89; break;
-                case X64Encoding_rr:
-                case X64Encoding_rm: *curr++ = 0x8B; break;
-                case X64Encoding_ri:
-                case X64Encoding_mi: *curr++ = 0xC7; reg = 0; break;
-                default: assert(0 && "invald operands for MOV"); break;
+        case X64Opcode_mov:
+        case X64Opcode_add:
+        case X64Opcode_sub: {
+            if (op0.kind == X64Operand_m32 && op1.kind == X64Operand_m32) {
+                x64_emit(result, X64Opcode_mov, scratch, op1, insn->is_64bit);
+                op1 = scratch;
             }
         } break;
         
-        case X64Opcode_add: {
-            switch (insn->encoding) {
-                case X64Encoding_mr: *curr++ = 0x01; break;
-                case X64Encoding_rr:
-                case X64Encoding_rm: *curr++ = 0x03; break;
-                case X64Encoding_ri:
-                case X64Encoding_mi: *curr++ = 0x81; reg = 0; break;
-                default: assert(0 && "invald operands for ADD"); break;
+        case X64Opcode_imul: {
+            if (op0.kind == X64Operand_m32) {
+                x64_emit(result, X64Opcode_mov, scratch, op0, insn->is_64bit);
+                x64_emit(result, X64Opcode_imul, scratch, op1, insn->is_64bit);
+                x64_emit(result, X64Opcode_mov, op0, scratch, insn->is_64bit);
+                return;
             }
         } break;
         
-        case X64Opcode_sub: {
-            switch (insn->encoding) {
-                case X64Encoding_mr: *curr++ = 0x29; break;
-                case X64Encoding_rr:
-                case X64Encoding_rm: *curr++ = 0x2B; break;
-                case X64Encoding_ri:
-                case X64Encoding_mi: *curr++ = 0x81; reg = 5; break;
-                default: assert(0 && "invald operands for SUB"); break;
-            } break;
+        case X64Opcode_movsxd: {
+            if (op1.kind == X64Operand_imm32) {
+                // NOTE(Alexander): the 64-bit mov sign extends its immediate
+                x64_emit(result, X64Opcode_mov, op0, op1, true);
+                return;
+            }
+            if (op0.kind == X64Operand_m32) {
+                x64_emit(result, X64Opcode_movsxd, scratch, op1, true);
+                x64_emit(result, X64Opcode_mov, op0, scratch, true);
+                return;
+            }
         } break;
         
-        case X64Opcode_imul: {
-            switch (insn->encoding) {
-                case X64Encoding_rr: 
-                case X64Encoding_rm: *curr++ = 0x0F; *curr++ = 0xAF; reg = 5; break;
-                default: assert(0 && "invald operands for IMUL"); break;
+        default: break;
+    }
+    
+    x64_emit(result, insn->opcode, op0, op1, insn->is_64bit);
+}
+
+// NOTE(Alexander): returns false if the allocation spilled without a scratch register
+bool
+x64_linear_scan(X64_Allocator* allocator, array(X64_Instruction)* instructions) {
+    Live_Interval* intervals = allocator->liveness.intervals;
+    
+    for_array(instructions, insn, insn_index) {
+        s32 index = (s32) insn_index;
+        
+        for (s32 active_index = 0; active_index < allocator->active_count; active_index++) {
+            u32 reg = allocator->active[active_index];
+            if (intervals[reg].end < index) {
+                allocator->free_regs[allocator->free_count++] = allocator->registers[reg];
+                allocator->active[active_index--] = allocator->active[--allocator->active_count];
             }
-        } break;
+        }
         
-        case X64Opcode_idiv: {
-            switch (insn->encoding) {
-                case X64Encoding_m:
-                case X64Encoding_r: *curr++ = 0xF7; reg = 7; break;
-                default: assert(0 && "invald operands for IDIV"); break;
+        // NOTE(Alexander): spill stores and scratch copies belong to the same line
+        smm first = array_count(allocator->result);
+        
+        if (x64_is_virtual_register(&insn->op0) && intervals[insn->op0.reg].start == index) {
+            // NOTE(Alexander): a copy from a value that dies here can reuse its register,
+            // a copy from a fixed register (e.g. the quotient in eax) can stay in it
+            s32 hint = allocator->hints[insn->op0.reg];
+            if (insn->opcode == X64Opcode_mov && x64_is_virtual_register(&insn->op1) &&
+                intervals[insn->op1.reg].end == index &&
+                allocator->locations[insn->op1.reg] == X64Location_Register) {
+                hint = allocator->registers[insn->op1.reg];
+            } else if (insn->opcode == X64Opcode_mov && insn->op1.kind == X64Operand_r32 && insn->op1.is_allocated) {
+                hint = insn->op1.reg_allocated;
             }
-        } break;
+            x64_allocate_interval(allocator, insn->op0.reg, index, hint);
+            if (allocator->needs_scratch) {
+                return false;
+            }
+        }
+        
+        x64_emit_allocated(allocator, insn);
+        for (smm result_index = first; result_index < array_count(allocator->result); result_index++) {
+            allocator->result[result_index].line = insn->line;
+        }
+    }
+    return true;
+}
+
+// NOTE(Alexander): wraps the allocated code in the prologue and an epilogue before every ret:
+//     push rbp                        restore the saved registers
+//     mov rbp, rsp                    mov rsp, rbp
+//     sub rsp, frame                  pop rbp
+//     save the callee-saved registers ret
+// The frame holds the variables, the spill slots and the saved registers, all at
+// negative offsets from rbp, and keeps rsp 16 byte aligned.
+void
+x64_emit_frame(X64_Builder* x64, X64_Allocation_Stats* stats) {
+    u32 used = 0;
+    for_array(x64->instructions, insn, insn_index) {
+        if (insn->op0.kind == X64Operand_r32) used |= bit(insn->op0.reg_allocated);
+        if (insn->op1.kind == X64Operand_r32) used |= bit(insn->op1.reg_allocated);
     }
     
-    // modrm
-    u8 modrm_mod = 0;
-    u8 modrm_reg = reg;
-    u8 modrm_rm = 0;
+    // NOTE(Alexander): rbp is saved by the push, rsp by the matching epilogue
+    used &= X64_CALLEE_SAVED_REGISTERS & ~(bit(X64Register_rsp) | bit(X64Register_rbp));
     
-    if (insn->encoding == X64Encoding_r || 
-        insn->encoding == X64Encoding_rr || 
-        insn->encoding == X64Encoding_ri) {
-        modrm_mod = 0b11; // direct addressing
-    } else {
-        modrm_mod = 0b10; // indirect addressing
+    s32 offsets[X64Register_r15 + 1];
+    for (int reg = X64Register_rax; reg <= X64Register_r15; reg++) {
+        if (is_bit_set(used, reg)) {
+            x64->stack_pointer = (x64->stack_pointer & ~7) - 8;
+            offsets[reg] = x64->stack_pointer;
+            stats->saved_count++;
+        }
     }
     
-    switch (insn->encoding) {
-        case X64Encoding_ri:
-        case X64Encoding_mi:
-        case X64Encoding_r: {
-            modrm_rm = insn->op0.reg_allocated;
-        } break;
+    // NOTE(Alexander): rsp is 16 byte aligned after the push, the return address made it off by 8
+    s32 frame_size = (s32) align_forward((umm) -x64->stack_pointer, 16);
+    stats->frame_size = frame_size;
+    
+    X64_Operand rbp = x64_register_operand(X64Register_rbp);
+    X64_Operand rsp = x64_register_operand(X64Register_rsp);
+    X64_Operand none = {};
+    X64_Operand frame = {};
+    frame.kind = X64Operand_imm32;
+    frame.imm = frame_size;
+    
+    array(X64_Instruction)* result = 0;
+    x64_emit(&result, X64Opcode_push, rbp, none, false);
+    x64_emit(&result, X64Opcode_mov, rbp, rsp, true);
+    if (frame_size > 0) {
+        x64_emit(&result, X64Opcode_sub, rsp, frame, true);
+    }
+    
+#if defined(BUILD_WINDOWS)
+    // NOTE(Alexander): windows commits the stack one guard page at a time, so the pages
+    // of large frames have to be touched in order before any of them is used
+    for (s32 probe = X64_STACK_PAGE_SIZE; probe < frame_size; probe += X64_STACK_PAGE_SIZE) {
+        x64_emit(&result, X64Opcode_mov, x64_memory_operand(X64Register_rbp, -probe),
+                 x64_register_operand(X64Register_rax), false);
+    }
+#endif
+    
+    for (int reg = X64Register_rax; reg <= X64Register_r15; reg++) {
+        if (is_bit_set(used, reg)) {
+            x64_emit(&result, X64Opcode_mov, x64_memory_operand(X64Register_rbp, offsets[reg]),
+                     x64_register_operand((X64_Register) reg), true);
+        }
+    }
+    
+    for_array(x64->instructions, insn, index) {
+        if (insn->opcode == X64Opcode_ret) {
+            smm first = array_count(result);
+            for (int reg = X64Register_rax; reg <= X64Register_r15; reg++) {
+                if (is_bit_set(used, reg)) {
+                    x64_emit(&result, X64Opcode_mov, x64_register_operand((X64_Register) reg),
+                             x64_memory_operand(X64Register_rbp, offsets[reg]), true);
+                }
+            }
+            x64_emit(&result, X64Opcode_mov, rsp, rbp, true);
+            x64_emit(&result, X64Opcode_pop, rbp, none, false);
+            for (smm epilogue_index = first; epilogue_index < array_count(result); epilogue_index++) {
+                result[epilogue_index].line = insn->line;
+            }
+        }
+        array_push(result, *insn);
+    }
+    
+    array_free(x64->instructions);
+    x64->instructions = result;
+}
+
+// NOTE(Alexander): replaces every virtual register in x64->instructions, spills never fail
+void
+allocate_x64_registers(X64_Builder* x64, X64_Allocation_Stats* stats) {
+    // NOTE(Alexander): every register except rsp and rbp, the caller-saved ones are taken first
+    // so the callee-saved ones only have to be saved by programs that need many registers
+    X64_Register pool[14];
+    s32 pool_count = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int reg = X64Register_rax; reg <= X64Register_r15; reg++) {
+            if (reg != X64Register_rsp && reg != X64Register_rbp &&
+                x64_is_callee_saved((X64_Register) reg) == (pass == 1)) {
+                pool[pool_count++] = (X64_Register) reg;
+            }
+        }
+    }
+    
+    X64_Allocator allocator = {};
+    allocator.x64 = x64;
+    allocator.liveness = x64_compute_liveness(x64->instructions);
+    u32 register_count = max(allocator.liveness.register_count, 1);
+    allocator.locations = (X64_Location*) calloc(register_count, sizeof(X64_Location));
+    allocator.registers = (X64_Register*) calloc(register_count, sizeof(X64_Register));
+    allocator.spill_offsets = (s32*) calloc(register_count, sizeof(s32));
+    allocator.is_constant = (b32*) calloc(register_count, sizeof(b32));
+    allocator.constants = (s32*) calloc(register_count, sizeof(s32));
+    allocator.hints = (s32*) malloc(register_count*sizeof(s32));
+    for (u32 reg = 0; reg < register_count; reg++) {
+        allocator.hints[reg] = -1;
+    }
+    
+    // NOTE(Alexander): a value is a constant if its only definition is `mov r, imm`
+    u32* def_counts = (u32*) calloc(register_count, sizeof(u32));
+    for_array(x64->instructions, insn, def_index) {
+        Live_Operands operands;
+        x64_live_operands(insn, &operands);
+        for (int operand_index = 0; operand_index < operands.def_count; operand_index++) {
+            u32 reg = operands.defs[operand_index];
+            def_counts[reg]++;
+            allocator.is_constant[reg] = (insn->opcode == X64Opcode_mov && !insn->is_64bit &&
+                                          insn->op1.kind == X64Operand_imm32);
+            allocator.constants[reg] = insn->op1.imm;
+        }
         
-        case X64Encoding_m: {
-            modrm_rm = insn->op0.reg_allocated;
-        } break;
+        // NOTE(Alexander): a value that is last used by a copy to a fixed register is hinted to it
+        if (insn->opcode == X64Opcode_mov && insn->op0.kind == X64Operand_r32 && insn->op0.is_allocated &&
+            x64_is_virtual_register(&insn->op1) &&
+            allocator.liveness.intervals[insn->op1.reg].end == (s32) def_index) {
+            allocator.hints[insn->op1.reg] = insn->op0.reg_allocated;
+        }
+    }
+    for (u32 reg = 0; reg < register_count; reg++) {
+        allocator.is_constant[reg] = allocator.is_constant[reg] && def_counts[reg] == 1;
+    }
+    free(def_counts);
+    
+    // NOTE(Alexander): idiv has no immediate form, so its divisor is never rematerialized,
+    // this is done after the definitions so it doesn't depend on the instruction order
+    for_array(x64->instructions, insn, idiv_index) {
+        if (insn->opcode == X64Opcode_idiv && x64_is_virtual_register(&insn->op0)) {
+            allocator.is_constant[insn->op0.reg] = false;
+        }
+    }
+    x64_compute_fixed_ranges(&allocator, x64->instructions);
+    
+    // NOTE(Alexander): the first try uses every register, if it has to spill it's redone
+    // with one register less that is used as scratch
+    s32 stack_pointer = x64->stack_pointer;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        X64_Allocation_Stats attempt_stats = {};
+        allocator.stats = &attempt_stats;
+        allocator.use_scratch = attempt > 0;
+        allocator.needs_scratch = false;
+        allocator.free_count = 0;
+        allocator.active_count = 0;
+        array_set_count(allocator.result, 0);
+        memset(allocator.locations, 0, register_count*sizeof(X64_Location));
+        memset(allocator.spill_offsets, 0, register_count*sizeof(s32));
+        x64->stack_pointer = stack_pointer;
         
-        case X64Encoding_mr: {
-            modrm_rm = insn->op0.reg_allocated;
-            modrm_reg = insn->op1.reg_allocated;
-        } break;
+        if (allocator.use_scratch) {
+            allocator.scratch = pool[0];
+            for (s32 pool_index = pool_count - 1; pool_index >= 1; pool_index--) {
+                allocator.free_regs[allocator.free_count++] = pool[pool_index];
+            }
+        } else {
+            for (s32 pool_index = pool_count - 1; pool_index >= 0; pool_index--) {
+                allocator.free_regs[allocator.free_count++] = pool[pool_index];
+            }
+        }
         
-        case X64Encoding_rr:
-        case X64Encoding_rm: {
-            modrm_reg = insn->op0.reg_allocated;
-            modrm_rm = insn->op1.reg_allocated;
-        } break;
+        if (x64_linear_scan(&allocator, x64->instructions)) {
+            attempt_stats.frame_size = -x64->stack_pointer;
+            *stats = attempt_stats;
+            break;
+        }
+    }
+    
+    array_free(x64->instructions);
+    x64->instructions = allocator.result;
+    x64_emit_frame(x64, stats);
+    
+    liveness_free(&allocator.liveness);
+    free(allocator.locations);
+    free(allocator.registers);
+    free(allocator.spill_offsets);
+    free(allocator.is_constant);
+    free(allocator.constants);
+    free(allocator.hints);
+    for (int reg = X64Register_rax; reg <= X64Register_r15; reg++) {
+        array_free(allocator.fixed_ranges[reg]);
+    }
+}
+
+void
+x64_print_allocation_stats(X64_Allocation_Stats* stats, f64 seconds) {
+    pln("Register allocation: % spilled (% split), % stores, % reloads, % rematerialized, % movs coalesced, % callee-saved, % byte frame, % ms",
+        f_int(stats->spill_count), f_int(stats->split_count), f_int(stats->store_count),
+        f_int(stats->reload_count), f_int(stats->remat_count), f_int(stats->coalesced_count),
+        f_int(stats->saved_count), f_int(stats->frame_size), f_float(seconds*1e3));
+}
+
+
+#define X64_MAX_INSTRUCTION_SIZE 15
+
+struct Machine_Code_Line {
+    u32 offset; // first byte of the line's code
+    u32 line;
+};
+
+struct Machine_Code {
+    u8* bytes;
+    umm size;
+    array(Machine_Code_Line)* lines; // an entry every time the source line changes, in code order
+};
+
+// X64 encoding table
+//
+// Every (opcode, operand form) that can be assembled is one row of DEF_X64_ENCODINGS,
+// the operand form is the kinds of op0 and op1 (e.g. rm = register, memory).
+// The columns are the opcode bytes, the modrm.reg field (an opcode extension or
+// R for the register operand), the immediate size and an optional short form
+// that replaces the last opcode byte when the immediate fits:
+//     Imm8 - the immediate fits in a signed byte, it's encoded as imm8
+//     One  - the immediate is 1, it's not encoded at all (shifts by one)
+//     Reg  - the register is added to the short byte and there is no modrm (push, pop)
+// Adding an instruction is adding its rows, the emitter itself doesn't know
+// about any opcode except the mov r, imm special cases.
+
+#define R X64_MODRM_REG_OPERAND
+#define DEF_X64_ENCODINGS \
+X64_ENCODING(mov,    mr, 1, 0x89, 0,    R, 0, None, 0,    0) \
+X64_ENCODING(mov,    rr, 1, 0x8B, 0,    R, 0, None, 0,    0) \
+X64_ENCODING(mov,    rm, 1, 0x8B, 0,    R, 0, None, 0,    0) \
+X64_ENCODING(mov,    ri, 1, 0xC7, 0,    0, 4, None, 0,    0) \
+X64_ENCODING(mov,    mi, 1, 0xC7, 0,    0, 4, None, 0,    0) \
+X64_ENCODING(add,    mr, 1, 0x01, 0,    R, 0, None, 0,    0) \
+X64_ENCODING(add,    rr, 1, 0x03, 0,    R, 0, None, 0,    0) \
+X64_ENCODING(add,    rm, 1, 0x03, 0,    R, 0, None, 0,    0) \
+X64_ENCODING(add,    ri, 1, 0x81, 0,    0, 4, Imm8, 0x83, 1) \
+X64_ENCODING(add,    mi, 1, 0x81, 0,    0, 4, Imm8, 0x83, 1) \
+X64_ENCODING(sub,    mr, 1, 0x29, 0,    R, 0, None, 0,    0) \
+X64_ENCODING(sub,    rr, 1, 0x2B, 0,    R, 0, None, 0,    0) \
+X64_ENCODING(sub,    rm, 1, 0x2B, 0,    R, 0, None, 0,    0) \
+X64_ENCODING(sub,    ri, 1, 0x81, 0,    5, 4, Imm8, 0x83, 1) \
+X64_ENCODING(sub,    mi, 1, 0x81, 0,    5, 4, Imm8, 0x83, 1) \
+X64_ENCODING(imul,   rr, 2, 0x0F, 0xAF, R, 0, None, 0,    0) \
+X64_ENCODING(imul,   rm, 2, 0x0F, 0xAF, R, 0, None, 0,    0) \
+X64_ENCODING(imul,   ri, 1, 0x69, 0,    R, 4, Imm8, 0x6B, 1) \
+X64_ENCODING(idiv,   r,  1, 0xF7, 0,    7, 0, None, 0,    0) \
+X64_ENCODING(idiv,   m,  1, 0xF7, 0,    7, 0, None, 0,    0) \
+X64_ENCODING(cdq,    none, 1, 0x99, 0,  0, 0, None, 0,    0) \
+X64_ENCODING(shl,    ri, 1, 0xC1, 0,    4, 1, One,  0xD1, 0) \
+X64_ENCODING(shl,    mi, 1, 0xC1, 0,    4, 1, One,  0xD1, 0) \
+X64_ENCODING(shr,    ri, 1, 0xC1, 0,    5, 1, One,  0xD1, 0) \
+X64_ENCODING(shr,    mi, 1, 0xC1, 0,    5, 1, One,  0xD1, 0) \
+X64_ENCODING(sar,    ri, 1, 0xC1, 0,    7, 1, One,  0xD1, 0) \
+X64_ENCODING(sar,    mi, 1, 0xC1, 0,    7, 1, One,  0xD1, 0) \
+X64_ENCODING(movsxd, rr, 1, 0x63, 0,    R, 0, None, 0,    0) \
+X64_ENCODING(movsxd, rm, 1, 0x63, 0,    R, 0, None, 0,    0) \
+X64_ENCODING(push,   r,  1, 0xFF, 0,    6, 0, Reg,  0x50, 0) \
+X64_ENCODING(pop,    r,  1, 0x8F, 0,    0, 0, Reg,  0x58, 0) \
+X64_ENCODING(ret,    none, 1, 0xC3, 0,  0, 0, None, 0,    0)
+
+#define X64_MODRM_REG_OPERAND 0xFF
+
+// NOTE(Alexander): operand forms, indexed by the kinds of op0 and op1
+#define X64_FORM(op0_kind, op1_kind) ((op0_kind)*4 + (op1_kind))
+#define X64_FORM_COUNT 16
+#define X64Form_none X64_FORM(X64Operand_None, X64Operand_None)
+#define X64Form_r  X64_FORM(X64Operand_r32, X64Operand_None)
+#define X64Form_m  X64_FORM(X64Operand_m32, X64Operand_None)
+#define X64Form_rr X64_FORM(X64Operand_r32, X64Operand_r32)
+#define X64Form_rm X64_FORM(X64Operand_r32, X64Operand_m32)
+#define X64Form_mr X64_FORM(X64Operand_m32, X64Operand_r32)
+#define X64Form_ri X64_FORM(X64Operand_r32, X64Operand_imm32)
+#define X64Form_mi X64_FORM(X64Operand_m32, X64Operand_imm32)
+
+enum X64_Short_Form {
+    X64Short_None,
+    X64Short_Imm8,
+    X64Short_One,
+    X64Short_Reg,
+};
+
+struct X64_Encoding_Entry {
+    u8 bytes[2];
+    u8 byte_count; // 0 if the operands can't be encoded
+    u8 reg; // modrm.reg, X64_MODRM_REG_OPERAND for the register operand
+    u8 imm_size;
+    u8 short_form; // X64_Short_Form
+    u8 short_byte;
+    u8 short_imm_size;
+};
+
+struct X64_Encoding_Table {
+    X64_Encoding_Entry entries[X64Opcode_Count][X64_FORM_COUNT];
+};
+
+constexpr X64_Encoding_Table
+x64_build_encoding_table() {
+    X64_Encoding_Table table = {};
+#define X64_ENCODING(opcode, form, byte_count, byte0, byte1, reg, imm_size, short_form, short_byte, short_imm_size) \
+table.entries[X64Opcode_##opcode][X64Form_##form] = { { byte0, byte1 }, byte_count, reg, imm_size, \
+X64Short_##short_form, short_byte, short_imm_size };
+    DEF_X64_ENCODINGS
+#undef X64_ENCODING
+    return table;
+}
+#undef R
+
+global constexpr X64_Encoding_Table x64_encoding_table = x64_build_encoding_table();
+
+void
+assemble_x64_instruction_to_machine_code(Machine_Code* code, X64_Instruction* insn, bool is_size_optimized=true) {
+    u8* curr = code->bytes + code->size;
+    X64_Operand* op0 = &insn->op0;
+    X64_Operand* op1 = &insn->op1;
+    
+    // NOTE(Alexander): mov r, imm has shorter forms that the table can't express
+    if (is_size_optimized && insn->opcode == X64Opcode_mov && insn->encoding == X64Encoding_ri) {
+        u8 rm = op0->reg_allocated;
+        if (op1->imm == 0) {
+            // NOTE(Alexander): xor r32, r32 also clears the upper half, it clobbers the flags
+            // but nothing reads them, there are no branches
+            if (rm & 8) *curr++ = 0b01000101;
+            *curr++ = 0x33;
+            *curr++ = 0b11000000 | ((rm & 7) << 3) | (rm & 7);
+            code->size = (umm) curr - (umm) code->bytes;
+            return;
+        }
+        
+        if (!insn->is_64bit) {
+            // NOTE(Alexander): mov r32, imm32 has the register in the opcode (B8+r)
+            if (rm & 8) *curr++ = 0b01000001;
+            *curr++ = 0xB8 + (rm & 7);
+            memcpy(curr, &op1->imm, sizeof(s32));
+            curr += sizeof(s32);
+            code->size = (umm) curr - (umm) code->bytes;
+            return;
+        }
     }
     
-    *curr++ = (modrm_mod << 6) | (modrm_reg << 3) | modrm_rm;
+    const X64_Encoding_Entry* entry = &x64_encoding_table.entries[insn->opcode][X64_FORM(op0->kind, op1->kind)];
+    assert(entry->byte_count > 0 && "invalid operands for the instruction");
+    
+    // NOTE(Alexander): rm is the memory operand or the only register, reg is the other register
+    bool has_modrm = op0->kind != X64Operand_None;
+    bool is_memory = op0->kind == X64Operand_m32 || op1->kind == X64Operand_m32;
+    X64_Operand* rm = (op0->kind == X64Operand_r32 && op1->kind != X64Operand_imm32 &&
+                       op1->kind != X64Operand_None) ? op1 : op0;
+    X64_Operand* reg_operand = (rm == op0 && op1->kind == X64Operand_r32) ? op1 : op0;
+    u8 reg = entry->reg == X64_MODRM_REG_OPERAND ? (u8) reg_operand->reg_allocated : entry->reg;
+    
+    bool is_short = false;
+    bool is_disp8 = false;
+    if (is_size_optimized) {
+        s32 imm = op1->imm;
+        is_short = ((entry->short_form == X64Short_Imm8 && imm >= S8_MIN && imm <= S8_MAX) ||
+                    (entry->short_form == X64Short_One && imm == 1) ||
+                    (entry->short_form == X64Short_Reg && op0->kind == X64Operand_r32));
+        is_disp8 = rm->displacement >= S8_MIN && rm->displacement <= S8_MAX;
+    }
     
-    // displacement
-    u8* disp_bytes = 0;
-    if (insn->encoding == X64Encoding_mr || insn->encoding == X64Encoding_mi) {
-        disp_bytes = (u8*) &insn->op0.displacement;
-    } else if (insn->encoding == X64Encoding_rm) {
-        disp_bytes = (u8*) &insn->op1.displacement;
+    bool is_reg_in_opcode = is_short && entry->short_form == X64Short_Reg;
+    if (is_reg_in_opcode) {
+        has_modrm = false;
+    }
+    
+    // REX, W for 64-bit operands, R and B extend the modrm reg and rm fields (or the
+    // register in the opcode) to r8-r15
+    u8 rex = (insn->is_64bit ? 0b01001000 : 0);
+    if (has_modrm) {
+        rex |= (reg & 8) ? 0b01000100 : 0;
+    }
+    if (has_modrm || is_reg_in_opcode) {
+        rex |= (rm->reg_allocated & 8) ? 0b01000001 : 0;
+    }
+    if (rex) {
+        *curr++ = rex;
     }
-    if (disp_bytes) {
-        for (s32 byte_index = 0; byte_index < sizeof(s32); byte_index++) {
-            // TODO(Alexander): little-endian
-            *curr++ = disp_bytes[byte_index];
+    
+    // opcode, the short form replaces the last byte
+    for (int byte_index = 0; byte_index < entry->byte_count; byte_index++) {
+        *curr++ = entry->bytes[byte_index];
+    }
+    if (is_short) {
+        curr[-1] = entry->short_byte;
+        if (is_reg_in_opcode) {
+            curr[-1] += rm->reg_allocated & 7;
         }
     }
     
-    // immediate
-    if (insn->encoding == X64Encoding_ri || 
-        insn->encoding == X64Encoding_mi) {
-        u8* imm_bytes = (u8*) &insn->op1.imm;
-        for (s32 byte_index = 0; byte_index < sizeof(s32); byte_index++) {
-            // TODO(Alexander): little-endian
-            *curr++ = imm_bytes[byte_index];
+    if (has_modrm) {
+        u8 modrm_mod = is_memory ? (is_disp8 ? 0b01 : 0b10) : 0b11;
+        *curr++ = (modrm_mod << 6) | ((reg & 7) << 3) | (rm->reg_allocated & 7);
+        
+        // NOTE(Alexander): rm = 100 means there is a SIB byte, rsp and r12 as base need one
+        if (is_memory && (rm->reg_allocated & 7) == 4) {
+            *curr++ = 0x24;
+        }
+        
+        if (is_memory) {
+            s32 disp_size = is_disp8 ? 1 : sizeof(s32);
+            memcpy(curr, &rm->displacement, disp_size); // little-endian
+            curr += disp_size;
         }
     }
     
+    s32 imm_size = is_short ? entry->short_imm_size : entry->imm_size;
+    memcpy(curr, &op1->imm, imm_size); // little-endian
+    curr += imm_size;
+    
     code->size = (umm) curr - (umm) code->bytes;
 }
 
-
+// NOTE(Alexander): the shortest encodings are picked unless is_size_optimized is false,
+// which always uses imm32 and disp32
 Machine_Code
-assemble_to_x64_machine_code(array(X64_Instruction)* instructions) {
+assemble_to_x64_machine_code(array(X64_Instruction)* instructions, bool is_size_optimized=true) {
     Machine_Code code = {};
-    code.bytes = (u8*) malloc(1024); // playing a bit unsafe, we can overflow this
+    code.bytes = (u8*) malloc(max(array_count(instructions), 1)*X64_MAX_INSTRUCTION_SIZE);
     
     // int3 breakpoint
     //*code.bytes = 0xCC;
     //code.size++;
     
     for_array(instructions, insn, _) {
-        assemble_x64_instruction_to_machine_code(&code, insn);
+        if (array_count(code.lines) == 0 || array_last(code.lines).line != insn->line) {
+            Machine_Code_Line line = { (u32) code.size, insn->line };
+            array_push(code.lines, line);
+        }
+        assemble_x64_instruction_to_machine_code(&code, insn, is_size_optimized);
     }
     
     return code;